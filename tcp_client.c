@@ -1,7 +1,9 @@
 // tcp_client_threadsafe.c (truncation warnings fixed)
+#define _GNU_SOURCE
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <malloc.h>
 #include <string.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -12,48 +14,597 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/inotify.h>
+#include <sys/fanotify.h>
 #include <sys/select.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <libgen.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <zlib.h>
+#include <sys/xattr.h>
+#include <sys/random.h>
+#include <linux/limits.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #define SERVER_PORT 12345
 #define BUFSIZE 4096
 #define WATCH_DIR "./client_dir"
 #define EVENT_MASK (IN_CREATE|IN_MODIFY|IN_CLOSE_WRITE|IN_MOVED_TO|IN_MOVED_FROM|IN_ATTRIB|IN_DELETE)
-#define MAX_TRACKED_FILES 256
-#define MAX_RECEIVED 256
 #define MAX_PATH 2048
 
 #define MSG_TYPE_FILE_SEND   0x01
 #define MSG_TYPE_FILE_DELETE 0x02
 #define MSG_TYPE_FILE_RENAME 0x03
+#define MSG_TYPE_FILE_BEGIN  0x04
+#define MSG_TYPE_FILE_CHUNK  0x05
+#define MSG_TYPE_FILE_END    0x06
+#define MSG_TYPE_CHUNK_REQ   0x07
+#define MSG_TYPE_HELLO       0x08
+#define MSG_TYPE_FILE_LOCAL  0x09
+#define MSG_TYPE_META        0x0A
+#define MSG_TYPE_FILE_HAVE   0x0B
+
+#define HELLO_LOCAL 0x01 // willing to copy in-kernel when directories share a filesystem
+#define HELLO_SEED  0x02 // wants to bulk-seed its tree to the peer before going incremental
+
+// Records of the --seed container, one stream per seed connection
+#define SEED_FILE  0x01
+#define SEED_BLOCK 0x02
+#define SEED_END   0x03
+
+#define CHUNK_SIZE (1024 * 1024)
+#define LARGE_FILE_THRESHOLD (8 * 1024 * 1024)
+#define MAX_PENDING 1024
+#define MAX_STREAMS 4
+#define HASH_THREADS 4
+#define MAX_REPAIR_ROUNDS 3 // failed re-requests of a chunk before the whole file is requested again
+#define TEMP_SUFFIX ".syncpart"
+#define MMAP_THRESHOLD (4 * 1024 * 1024)
+#define DROP_BEHIND (8 * 1024 * 1024)
+#define ARENA_BLOCK (64 * 1024)
+#define BUFFER_POOL_SIZE (HASH_THREADS + 2)
+#define RULE_ACTIVE_MAX 64 // automaton states tracked at once while matching a path
+#define IGNORE_FILE ".syncignore"
+#define STATE_FILE ".syncstate" // per-file version vectors, kept in WATCH_DIR and never synced
+#define STATE_MAGIC "SYNCVV1\n"
+#define VV_NODES 4 // distinct peers a version vector can count edits for
+#define META_DELAY_MS 200 // attribute updates wait this long for more events to batch with
+#define SEED_STREAMS 4 // extra connections opened for --seed
+#define SEED_WALKERS 4
+#define SEED_BLOCKS 16 // blocks in flight between the seed reader, workers and senders
+#define TLS_MAX_FD 1024
+
+#define WATCH_INOTIFY  0 // one watch on WATCH_DIR itself; deeper changes are found by polling
+#define WATCH_FANOTIFY 1 // one mark on the whole filesystem, events for every directory
+#define FAN_EVENTS (FAN_CREATE|FAN_MODIFY|FAN_CLOSE_WRITE|FAN_ATTRIB|FAN_DELETE|FAN_RENAME)
+#define DIR_CACHE_SLOTS 4096
+
+// What to do with an incoming version of a file, from vv_decide()
+#define VV_TAKE        0 // it supersedes ours
+#define VV_DROP        1 // ours already includes it
+#define VV_KEEP_LOCAL  2 // concurrent edits; ours stays, theirs becomes a conflict copy
+#define VV_KEEP_REMOTE 3 // concurrent edits; theirs replaces ours, which becomes a conflict copy
+
+#define READ_AUTO  0 // mmap above MMAP_THRESHOLD, stdio below
+#define READ_STDIO 1
+#define READ_MMAP  2
+#define GLOBAL_RATE_LIMIT 0 // bytes per second, 0 = unlimited; --rate overrides
+#define MAX_RATE_RULES 64 // each of hour windows, peer caps and priority rules
+
+#define PRIO_URGENT 0
+#define PRIO_NORMAL 1
+#define PRIO_BULK   2
+
+// Applied before the rules file, which can re-include with "!" (e.g. "!.gitignore").
+const char *default_rules[] = { ".*", "*.swp" };
 
 char LOG_FILE[128] = "sync.log";
 
-pthread_mutex_t file_track_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t recent_recv_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t rate_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-typedef struct { char filename[MAX_PATH]; time_t last_sent_mtime; } FileTracker;
-typedef struct { char filename[MAX_PATH]; time_t received_time; } ReceivedFile;
-FileTracker tracked_files[MAX_TRACKED_FILES]; int tracked_count = 0;
-ReceivedFile recently_received[MAX_RECEIVED]; int recent_count = 0;
+// Edits per node, indexed by slot in vv_nodes[]; slot 0 is this node.
+typedef struct { uint32_t c[VV_NODES]; } VersionVector;
 
-// Get relative path inside WATCH_DIR
-int get_relative_path(const char *full_path, char *rel_path, size_t maxlen) {
+// One per relative path ever seen, interned for the life of the process. Holds the
+// per-file sync state, so lookups are a hash probe and paths compare by pointer.
+typedef struct {
+    const char *rel; uint32_t hash;
+    // The contents vv describes. nsec is -1 and ino 0 until seen in a stat.
+    time_t last_sent_mtime; off_t last_sent_size; long last_sent_nsec; ino_t last_sent_ino;
+    VersionVector vv, peer_vv; // our version, and the newest the peer is known to hold
+    int queued; // 1 + index into pending[], 0 when not queued
+    int meta_queued; // 1 + index into meta_pending[]
+    int modified; // data written since the last sync, so attribute events still need a full send
+    mode_t last_mode; uid_t last_uid; gid_t last_gid; struct timespec last_mtim, last_ctim;
+} PathEntry;
+// Ignore rules compile into a trie over path segments. Literal segments are edges in
+// one hash table; glob segments hang off their parent; "**" is a node that loops on
+// any segment. rule/dir_rule hold the index of the last rule ending here (-1: none).
+typedef struct RuleNode {
+    struct RuleNode *parent, *star2, *globs, *next_glob;
+    const char *seg; size_t len; int is_star2;
+    int rule, dir_rule; int neg, dir_neg;
+} RuleNode;
+typedef struct ArenaBlock { struct ArenaBlock *next; size_t used; size_t size; char data[]; } ArenaBlock;
+typedef struct { uint64_t calls; uint64_t bytes; } AllocStats;
+typedef struct { double tokens; uint64_t rate; struct timespec last; } TokenBucket;
+typedef struct { int start_hour; int end_hour; uint64_t bps; } RateWindow;
+typedef struct { const char *ip; uint64_t bps; } PeerRate; // ip is an fnmatch pattern
+typedef struct { const char *pattern; int priority; } PriorityRule;
+typedef struct { PathEntry *entry; off_t size; int priority; } PendingTransfer;
+typedef struct { PathEntry *entry; struct stat st; } MetaUpdate;
+typedef struct { int fd; unsigned char *map; off_t size; off_t dropped; } SourceFile;
+typedef struct { off_t offset; off_t len; } Extent;
+typedef struct { PathEntry *entry; SourceFile src; off_t size; off_t offset; time_t mtime; VersionVector vv; int priority; uint32_t nchunks; uint32_t file_crc; Extent *ext; uint32_t next, cur, ext_cap; } OutgoingStream;
+typedef struct { uint64_t offset; uint32_t len; uint32_t crc; } ChunkSum;
+typedef struct {
+    PathEntry *entry; char full[MAX_PATH]; char temp[MAX_PATH]; int fd;
+    uint64_t size; mode_t mode; struct utimbuf ut;
+    VersionVector vv;
+    ChunkSum *sums; uint32_t *actual; uint32_t nsums, cap;
+    int repairs_outstanding, rounds, ended; // ended: the sender's chunk list is in, waiting on repairs
+    uint64_t expected_bytes, received_bytes;
+} IncomingStream;
+typedef struct { int fd; const ChunkSum *sums; uint32_t n; uint32_t next; uint32_t *out; int active; } HashJob;
+typedef struct { const char *rel; ino_t ino; off_t size; mode_t mode; struct utimbuf ut; int ok, deferred; VersionVector vv; } SeedFile;
+typedef struct SeedBlock {
+    struct SeedBlock *next;
+    int kind, conn; uint32_t file; uint64_t offset; uint32_t len, stored, crc;
+    unsigned char *data, *zdata;
+} SeedBlock;
+typedef struct { uint32_t id; int fd; uint32_t left; int bad; size_t result; const char *rel; mode_t mode; struct utimbuf ut; } SeedOpen;
+typedef struct { SeedBlock *head, *tail; int closed; pthread_mutex_t mu; pthread_cond_t cv; } SeedQueue;
+typedef struct {
+    pthread_mutex_t mu; pthread_cond_t cv;
+    const char **dirs; size_t ndirs, dcap; int busy;
+    SeedFile *files; size_t nfiles, fcap;
+    ArenaBlock *arena;
+} SeedState;
+typedef struct { int srv; size_t len; int rounds; } TlsBench;
+// Resolved fanotify directory handle. The key is the fsid followed by the file_handle, as
+// reported; dir is NULL for directories outside WATCH_DIR.
+typedef struct { uint32_t hash; uint32_t len; int used; PathEntry *dir; unsigned char key[sizeof(__kernel_fsid_t) + sizeof(struct file_handle) + MAX_HANDLE_SZ]; } DirHandle;
+
+// Global link budget by local hour, [start_hour, end_hour), from --rate-file. Hours not covered use global_rate.
+RateWindow rate_schedule[MAX_RATE_RULES]; int rate_window_count = 0;
+uint64_t global_rate = GLOBAL_RATE_LIMIT;
+
+// Additional per-peer cap, matched on the peer address. First match wins.
+PeerRate peer_rates[MAX_RATE_RULES]; int peer_rate_count = 0;
+
+// --rate-file rules are tried before the defaults. First match wins. Unmatched files are
+// NORMAL, or BULK above LARGE_FILE_THRESHOLD.
+PriorityRule priority_rules[MAX_RATE_RULES]; int priority_rule_count = 0;
+const PriorityRule default_priority_rules[] = {
+    { "*.conf", PRIO_URGENT }, { "*.cfg", PRIO_URGENT }, { "*.ini", PRIO_URGENT },
+    { "*.json", PRIO_URGENT }, { "*.yaml", PRIO_URGENT }, { "*.yml", PRIO_URGENT },
+    { "*.iso", PRIO_BULK }, { "*.img", PRIO_BULK }, { "*.bak", PRIO_BULK }, { "*.tar*", PRIO_BULK },
+};
+
+ArenaBlock *arena = NULL;
+ArenaBlock *rule_arena = NULL;
+RuleNode *rule_root = NULL, **rule_edges = NULL; size_t rule_edge_cap = 0, rule_edge_count = 0; int rule_count = 0;
+char ignore_file[MAX_PATH] = WATCH_DIR "/" IGNORE_FILE;
+PathEntry **path_table = NULL; size_t path_table_cap = 0, path_count = 0;
+AllocStats alloc_stats;
+char *buffer_pool[BUFFER_POOL_SIZE]; int buffers_free = 0, buffers_made = 0;
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t hash_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t hash_work = PTHREAD_COND_INITIALIZER, hash_done = PTHREAD_COND_INITIALIZER;
+HashJob *hash_job = NULL; uint64_t hash_generation = 0; int hash_threads = 0;
+// Scratch paths for the main thread: scanning, sending, and the message being received.
+char scan_path[MAX_PATH], xfer_path[MAX_PATH];
+char msg_name[MAX_PATH], msg_full[MAX_PATH], msg_name2[MAX_PATH], msg_full2[MAX_PATH];
+FILE *log_fp = NULL;
+volatile sig_atomic_t mem_report_requested = 0;
+int mem_report_every_poll = 0;
+PendingTransfer pending[MAX_PENDING]; int pending_count = 0;
+MetaUpdate meta_pending[MAX_PENDING]; int meta_count = 0;
+struct timespec meta_last;
+int sync_xattrs = 0;
+char xattr_list[XATTR_LIST_MAX], xattr_value[XATTR_SIZE_MAX];
+OutgoingStream outgoing[MAX_STREAMS]; int outgoing_count = 0;
+IncomingStream incoming[MAX_STREAMS]; int incoming_count = 0;
+TokenBucket global_bucket, peer_bucket;
+char chunk_buf[CHUNK_SIZE];
+int read_strategy = READ_AUTO;
+int allow_local = 1;
+int seed_mode = 0, peer_seeds = 0;
+int watcher = WATCH_INOTIFY;
+char watch_root[MAX_PATH]; size_t watch_root_len = 0;
+int fan_mount_fd = -1; uint32_t fan_cookie = 0;
+DirHandle *dir_cache = NULL;
+char moved_from[MAX_PATH] = "";
+uint32_t moved_cookie = 0;
+// --tls: TLS 1.3 with certificates checked both ways. With kernel TLS the socket takes
+// plaintext after the handshake, so sends bypass OpenSSL and file data can go by sendfile.
+int use_tls = 0, tls_ktls = 1;
+char tls_cert[MAX_PATH] = "certs/client.crt", tls_key[MAX_PATH] = "certs/client.key", tls_ca[MAX_PATH] = "certs/ca.crt";
+SSL_CTX *tls_ctx = NULL;
+SSL *tls_sessions[TLS_MAX_FD];
+unsigned char tls_ktls_send[TLS_MAX_FD];
+int local_peer = 0; // peer's directory is on our filesystem: copy in-kernel instead of over the socket
+char peer_dir[MAX_PATH];
+uint64_t vv_nodes[VV_NODES]; int vv_node_count = 0;
+uint64_t peer_node = 0, state_peer = 0; // the connected peer, and the one peer_vv was saved against
+int state_dirty = 0;
+pthread_mutex_t vv_mutex = PTHREAD_MUTEX_INITIALIZER;
+sigjmp_buf sigbus_jmp;
+volatile sig_atomic_t sigbus_armed = 0;
+uint32_t crc32c_table[8][256];
+uint32_t (*crc32c)(uint32_t crc, const void *buf, size_t len);
+
+// Relative path inside WATCH_DIR, pointing into full_path; NULL for paths outside it.
+const char *rel_of(const char *full_path) {
     size_t base_len = strlen(WATCH_DIR);
-    if (strncmp(full_path, WATCH_DIR, base_len) != 0) return -1;
+    if (strncmp(full_path, WATCH_DIR, base_len) != 0) return NULL;
     const char *sub = full_path + base_len;
     if (*sub == '/') sub++;
-    if (strlen(sub) >= maxlen) {
-        fprintf(stderr, "Warning: relative path too long, truncating.\n");
+    return sub;
+}
+
+// Receivers write to a dot-prefixed TEMP_SUFFIX file next to the target; never sync those.
+int is_temp_name(const char *name) {
+    size_t nl = strlen(name), sl = strlen(TEMP_SUFFIX);
+    return nl >= sl && strcmp(name + nl - sl, TEMP_SUFFIX) == 0;
+}
+
+int temp_path(const char *full, char *temp, size_t len) {
+    const char *base = strrchr(full, '/');
+    if (!base) return -1;
+    int ret = snprintf(temp, len, "%.*s/.%s%s", (int)(base - full), full, base + 1, TEMP_SUFFIX);
+    return ret < 0 || ret >= (int)len ? -1 : 0;
+}
+
+// Every heap allocation the sync engine makes goes through here, so the memory
+// report can show that steady-state operation allocates nothing. The transfer path
+// also stays off stdio, whose FILE objects are allocated by libc.
+void *counted_realloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+    if (p) {
+        __atomic_add_fetch(&alloc_stats.calls, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&alloc_stats.bytes, size, __ATOMIC_RELAXED);
+    }
+    return p;
+}
+
+// Bump allocator. The global arena holds interned paths for the life of the process;
+// seeding uses a private one that is freed as a whole when it is done.
+void *arena_alloc(ArenaBlock **arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (!*arena || (*arena)->size - (*arena)->used < size) {
+        size_t bsize = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        ArenaBlock *b = counted_realloc(NULL, sizeof(ArenaBlock) + bsize);
+        if (!b) return NULL;
+        b->next = *arena;
+        b->used = 0;
+        b->size = bsize;
+        *arena = b;
+    }
+    void *p = (*arena)->data + (*arena)->used;
+    (*arena)->used += size;
+    return p;
+}
+
+char *arena_strdup(ArenaBlock **arena, const char *str) {
+    size_t len = strlen(str) + 1;
+    char *p = arena_alloc(arena, len);
+    if (p) memcpy(p, str, len);
+    return p;
+}
+
+void arena_free(ArenaBlock **arena) {
+    while (*arena) {
+        ArenaBlock *next = (*arena)->next;
+        free(*arena);
+        *arena = next;
+    }
+}
+
+uint32_t path_hash(const char *rel) {
+    uint32_t h = 2166136261u;
+    while (*rel) h = (h ^ (unsigned char)*rel++) * 16777619u;
+    return h;
+}
+
+int path_table_grow(void) {
+    size_t cap = path_table_cap ? path_table_cap * 2 : 1024;
+    PathEntry **t = counted_realloc(NULL, cap * sizeof(PathEntry *));
+    if (!t) return -1;
+    memset(t, 0, cap * sizeof(PathEntry *));
+    for (size_t i = 0; i < path_table_cap; i++) {
+        if (!path_table[i]) continue;
+        size_t j = path_table[i]->hash & (cap - 1);
+        while (t[j]) j = (j + 1) & (cap - 1);
+        t[j] = path_table[i];
+    }
+    free(path_table);
+    path_table = t;
+    path_table_cap = cap;
+    return 0;
+}
+
+// Interned entry for a WATCH_DIR-relative path. With create == 0, unseen paths give NULL.
+PathEntry *path_entry(const char *rel, int create) {
+    if (!rel) return NULL;
+    uint32_t h = path_hash(rel);
+    if (path_table_cap) {
+        for (size_t i = h & (path_table_cap - 1); path_table[i]; i = (i + 1) & (path_table_cap - 1))
+            if (path_table[i]->hash == h && strcmp(path_table[i]->rel, rel) == 0) return path_table[i];
+    }
+    if (!create) return NULL;
+    if ((path_count + 1) * 10 > path_table_cap * 7 && path_table_grow() < 0) return NULL;
+    size_t len = strlen(rel);
+    PathEntry *e = arena_alloc(&arena, sizeof(PathEntry) + len + 1);
+    if (!e) return NULL;
+    memset(e, 0, sizeof(*e));
+    char *copy = (char *)(e + 1);
+    memcpy(copy, rel, len + 1);
+    e->rel = copy;
+    e->hash = h;
+    size_t i = h & (path_table_cap - 1);
+    while (path_table[i]) i = (i + 1) & (path_table_cap - 1);
+    path_table[i] = e;
+    path_count++;
+    return e;
+}
+
+int full_path(const PathEntry *e, char *out, size_t len) {
+    int ret = snprintf(out, len, "%s/%s", WATCH_DIR, e->rel);
+    return ret < 0 || ret >= (int)len ? -1 : 0;
+}
+
+RuleNode *rule_node(RuleNode *parent, const char *seg, size_t len) {
+    RuleNode *n = arena_alloc(&rule_arena, sizeof(RuleNode) + len + 1);
+    if (!n) return NULL;
+    memset(n, 0, sizeof(*n));
+    char *copy = (char *)(n + 1);
+    memcpy(copy, seg, len);
+    copy[len] = 0;
+    n->parent = parent;
+    n->seg = copy;
+    n->len = len;
+    n->rule = n->dir_rule = -1;
+    return n;
+}
+
+size_t rule_edge_slot(const RuleNode *parent, const char *seg, size_t len) {
+    uint32_t h = 2166136261u ^ (uint32_t)((uintptr_t)parent >> 4);
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)seg[i]) * 16777619u;
+    return h & (rule_edge_cap - 1);
+}
+
+RuleNode *rule_edge_find(const RuleNode *parent, const char *seg, size_t len) {
+    if (!rule_edge_cap) return NULL;
+    for (size_t i = rule_edge_slot(parent, seg, len); rule_edges[i]; i = (i + 1) & (rule_edge_cap - 1)) {
+        RuleNode *c = rule_edges[i];
+        if (c->parent == parent && c->len == len && memcmp(c->seg, seg, len) == 0) return c;
+    }
+    return NULL;
+}
+
+RuleNode *rule_edge_add(RuleNode *parent, const char *seg, size_t len) {
+    if ((rule_edge_count + 1) * 10 > rule_edge_cap * 7) {
+        size_t cap = rule_edge_cap ? rule_edge_cap * 2 : 64;
+        RuleNode **old = rule_edges, **t = counted_realloc(NULL, cap * sizeof(RuleNode *));
+        if (!t) return NULL;
+        memset(t, 0, cap * sizeof(RuleNode *));
+        size_t old_cap = rule_edge_cap;
+        rule_edges = t;
+        rule_edge_cap = cap;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (!old[i]) continue;
+            size_t j = rule_edge_slot(old[i]->parent, old[i]->seg, old[i]->len);
+            while (t[j]) j = (j + 1) & (cap - 1);
+            t[j] = old[i];
+        }
+        free(old);
+    }
+    RuleNode *n = rule_node(parent, seg, len);
+    if (!n) return NULL;
+    size_t i = rule_edge_slot(parent, seg, len);
+    while (rule_edges[i]) i = (i + 1) & (rule_edge_cap - 1);
+    rule_edges[i] = n;
+    rule_edge_count++;
+    return n;
+}
+
+RuleNode *rule_child(RuleNode *parent, const char *seg, size_t len) {
+    if (len == 2 && seg[0] == '*' && seg[1] == '*') {
+        if (!parent->star2 && (parent->star2 = rule_node(parent, seg, len))) parent->star2->is_star2 = 1;
+        return parent->star2;
+    }
+    if (!memchr(seg, '*', len) && !memchr(seg, '?', len) && !memchr(seg, '[', len) && !memchr(seg, '\\', len)) {
+        RuleNode *c = rule_edge_find(parent, seg, len);
+        return c ? c : rule_edge_add(parent, seg, len);
+    }
+    for (RuleNode *g = parent->globs; g; g = g->next_glob)
+        if (g->len == len && memcmp(g->seg, seg, len) == 0) return g;
+    RuleNode *g = rule_node(parent, seg, len);
+    if (g) {
+        g->next_glob = parent->globs;
+        parent->globs = g;
+    }
+    return g;
+}
+
+// Compiles one gitignore-style line: "#" comments, "!" re-includes, a trailing "/"
+// matches directories only, and a pattern with a "/" other than at the end is
+// anchored at WATCH_DIR; anything else matches at any depth.
+void rule_add(char *line) {
+    size_t len = strcspn(line, "\r\n");
+    while (len && line[len - 1] == ' ' && (len < 2 || line[len - 2] != '\\')) len--;
+    line[len] = 0;
+    if (!len || line[0] == '#') return;
+    int neg = line[0] == '!', dir_only = 0;
+    char *p = line + neg;
+    if (p[0] == '\\' && (p[1] == '!' || p[1] == '#')) p++;
+    len = strlen(p);
+    if (len && p[len - 1] == '/') {
+        dir_only = 1;
+        p[--len] = 0;
+    }
+    int anchored = strchr(p, '/') != NULL;
+    if (*p == '/') p++;
+    if (!*p) return;
+
+    RuleNode *n = anchored ? rule_root : rule_child(rule_root, "**", 2);
+    while (n && *p) {
+        size_t sl = strcspn(p, "/");
+        if (sl) n = rule_child(n, p, sl);
+        p += sl + (p[sl] == '/');
+    }
+    if (!n) return;
+    if (dir_only) {
+        n->dir_rule = rule_count;
+        n->dir_neg = neg;
+    } else {
+        n->rule = rule_count;
+        n->neg = neg;
+    }
+    rule_count++;
+}
+
+// (Re)builds the automaton from default_rules and the rules file, if there is one.
+void load_rules(void) {
+    arena_free(&rule_arena);
+    free(rule_edges);
+    rule_edges = NULL;
+    rule_edge_cap = rule_edge_count = 0;
+    rule_count = 0;
+    rule_root = rule_node(NULL, "", 0);
+    if (!rule_root) return;
+    char line[MAX_PATH];
+    for (size_t i = 0; i < sizeof(default_rules) / sizeof(default_rules[0]); i++) {
+        snprintf(line, sizeof(line), "%s", default_rules[i]);
+        rule_add(line);
+    }
+    FILE *f = fopen(ignore_file, "r");
+    if (!f) return;
+    while (fgets(line, sizeof(line), f)) rule_add(line);
+    fclose(f);
+    printf("? Loaded %d ignore rules from %s\n", rule_count, ignore_file);
+}
+
+int rule_state_add(RuleNode **set, int n, RuleNode *node) {
+    for (int i = 0; i < n; i++)
+        if (set[i] == node) return n;
+    if (n < RULE_ACTIVE_MAX) set[n++] = node;
+    return n;
+}
+
+// Nonzero if rel (a directory when is_dir), or any directory above it, is excluded.
+// One pass over the path: every segment advances the set of live trie states, and
+// an excluded directory ends the walk since nothing below it can be re-included.
+int rule_excluded(const char *rel, int is_dir) {
+    if (strcmp(rel, STATE_FILE) == 0) return 1;
+    if (!rule_root) return 0;
+    RuleNode *cur[RULE_ACTIVE_MAX], *next[RULE_ACTIVE_MAX];
+    char seg[NAME_MAX + 1];
+    int n = 1;
+    cur[0] = rule_root;
+    if (rule_root->star2) n = rule_state_add(cur, n, rule_root->star2);
+    while (*rel) {
+        size_t len = strcspn(rel, "/");
+        int last = rel[len] == 0;
+        if (len > NAME_MAX) return 0;
+        memcpy(seg, rel, len);
+        seg[len] = 0;
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            RuleNode *c = rule_edge_find(cur[i], rel, len);
+            if (c) m = rule_state_add(next, m, c);
+            for (RuleNode *g = cur[i]->globs; g; g = g->next_glob)
+                if (fnmatch(g->seg, seg, 0) == 0) m = rule_state_add(next, m, g);
+            if (cur[i]->is_star2) m = rule_state_add(next, m, cur[i]);
+        }
+        // A "**" entered without consuming this segment only matches from the next one on, so
+        // "foo/**" covers what is inside foo but not foo itself. States past m0 are those.
+        int m0 = m;
+        for (int i = 0; i < m; i++)
+            if (next[i]->star2) m = rule_state_add(next, m, next[i]->star2);
+
+        int best = -1, neg = 0, dir = !last || is_dir;
+        for (int i = 0; i < m0; i++) {
+            if (next[i]->rule > best) {
+                best = next[i]->rule;
+                neg = next[i]->neg;
+            }
+            if (dir && next[i]->dir_rule > best) {
+                best = next[i]->dir_rule;
+                neg = next[i]->dir_neg;
+            }
+        }
+        if (best >= 0 && !neg) return 1;
+        if (last || !m) return 0;
+        memcpy(cur, next, m * sizeof(RuleNode *));
+        n = m;
+        rel += len + 1;
     }
-    snprintf(rel_path, maxlen, "%s", sub);
-    rel_path[maxlen-1] = 0;
     return 0;
 }
 
+// Fixed set of CHUNK_SIZE transfer buffers, created on first use and recycled after.
+char *buffer_get(void) {
+    char *b = NULL;
+    pthread_mutex_lock(&pool_mutex);
+    if (buffers_free) b = buffer_pool[--buffers_free];
+    else if (buffers_made < BUFFER_POOL_SIZE && (b = counted_realloc(NULL, CHUNK_SIZE))) buffers_made++;
+    pthread_mutex_unlock(&pool_mutex);
+    return b;
+}
+
+void buffer_put(char *b) {
+    if (!b) return;
+    pthread_mutex_lock(&pool_mutex);
+    buffer_pool[buffers_free++] = b;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void on_sigusr1(int sig) {
+    (void)sig;
+    mem_report_requested = 1;
+}
+
+// Allocations made through counted_realloc() plus what malloc itself reports, which also
+// covers libc and OpenSSL. Reads /proc without stdio so reporting allocates nothing either.
+void report_memory(void) {
+    static uint64_t last_calls = 0;
+    static size_t last_heap = 0;
+    long pages = 0, resident = 0;
+    char statm[128];
+    int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t n = read(fd, statm, sizeof(statm) - 1);
+        statm[n > 0 ? n : 0] = 0;
+        if (sscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        close(fd);
+    }
+    struct mallinfo2 mi = mallinfo2();
+    size_t arena_bytes = 0;
+    for (ArenaBlock *b = arena; b; b = b->next) arena_bytes += b->size;
+    uint64_t calls = __atomic_load_n(&alloc_stats.calls, __ATOMIC_RELAXED);
+    printf("? Memory: rss %.1f MB, %llu allocations (%.1f MB), %llu since last report, "
+           "heap %zu KB in use (%+ld KB), arena %zu KB, %zu paths, %d/%d buffers free\n",
+           resident * (double)sysconf(_SC_PAGESIZE) / (1 << 20), (unsigned long long)calls,
+           __atomic_load_n(&alloc_stats.bytes, __ATOMIC_RELAXED) / (double)(1 << 20),
+           (unsigned long long)(calls - last_calls), mi.uordblks >> 10,
+           last_heap ? ((long)mi.uordblks - (long)last_heap) / 1024 : 0L, arena_bytes >> 10, path_count,
+           buffers_free, buffers_made);
+    last_calls = calls;
+    last_heap = mi.uordblks;
+}
+
 static void ensure_dir(const char *path) {
     char tmp[MAX_PATH];
     snprintf(tmp, sizeof(tmp), "%s", path);
@@ -93,9 +644,13 @@ void setup_log_file(const char *peer_ip) {
 
 void log_event(const char *direction, const char *action, const char *filename, const char *filename2) {
     pthread_mutex_lock(&log_mutex);
-    FILE *log = fopen(LOG_FILE, "a+");
-    if (!log) { pthread_mutex_unlock(&log_mutex); return; }
-    fseek(log, 0, SEEK_END);
+    // Opened once and kept; each row is flushed so the log stays readable while running.
+    if (!log_fp) {
+        log_fp = fopen(LOG_FILE, "a+");
+        if (!log_fp) { pthread_mutex_unlock(&log_mutex); return; }
+        fseek(log_fp, 0, SEEK_END);
+    }
+    FILE *log = log_fp;
     if (ftell(log) == 0) {
         fprintf(log, "+---------------------+----------------------+----------------------+\n");
         fprintf(log, "|      Timestamp      |       CLIENT         |       SERVER         |\n");
@@ -103,40 +658,332 @@ void log_event(const char *direction, const char *action, const char *filename,
     }
     char ts[64], c[256] = "", s[256] = "";
     time_t now = time(NULL);
-    strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    struct tm tm;
+    // localtime() would reload the zone, and allocate, on every call
+    strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm));
     if (strstr(direction, "CLIENT"))
         snprintf(c, sizeof(c), "%s: %s %s", action, filename, filename2 ? filename2 : "");
     else
         snprintf(s, sizeof(s), "%s: %s %s", action, filename, filename2 ? filename2 : "");
     fprintf(log, "| %-19s | %-20s | %-20s |\n", ts, c, s);
-    fclose(log);
+    fflush(log);
     pthread_mutex_unlock(&log_mutex);
 }
 
+// OpenSSL allocates through these, so its allocations show in the memory report too.
+void *tls_malloc(size_t n, const char *file, int line) {
+    (void)file; (void)line;
+    return counted_realloc(NULL, n);
+}
+
+void *tls_realloc(void *p, size_t n, const char *file, int line) {
+    (void)file; (void)line;
+    return counted_realloc(p, n);
+}
+
+void tls_free(void *p, const char *file, int line) {
+    (void)file; (void)line;
+    free(p);
+}
+
+int tls_init(void) {
+    CRYPTO_set_mem_functions(tls_malloc, tls_realloc, tls_free); // only takes before OpenSSL's first allocation
+    tls_ctx = SSL_CTX_new(TLS_method());
+    if (!tls_ctx) return -1;
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_3_VERSION);
+    SSL_CTX_set_num_tickets(tls_ctx, 0); // no resumption, and nothing but our data in the record stream
+    SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+    if (tls_ktls) SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+    if (SSL_CTX_use_certificate_chain_file(tls_ctx, tls_cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_ctx, tls_key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_load_verify_locations(tls_ctx, tls_ca, NULL) != 1) {
+        ERR_print_errors_fp(stderr);
+        fprintf(stderr, "Warning: cannot load TLS certificate %s, key %s or CA %s (see make certs)\n", tls_cert, tls_key, tls_ca);
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Handshake on a connected socket. A no-op without --tls.
+int tls_start(int fd, int server) {
+    if (!tls_ctx) return 0;
+    if (fd < 0 || fd >= TLS_MAX_FD) return -1;
+    SSL *ssl = SSL_new(tls_ctx);
+    if (!ssl) return -1;
+    SSL_set_fd(ssl, fd);
+    if ((server ? SSL_accept(ssl) : SSL_connect(ssl)) != 1) {
+        ERR_print_errors_fp(stderr);
+        fprintf(stderr, "Warning: TLS handshake failed\n");
+        SSL_free(ssl);
+        return -1;
+    }
+    tls_sessions[fd] = ssl;
+    tls_ktls_send[fd] = BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+    return 0;
+}
+
+void tls_report(int fd) {
+    SSL *ssl = fd >= 0 && fd < TLS_MAX_FD ? tls_sessions[fd] : NULL;
+    if (!ssl) return;
+    printf("?? %s %s, kernel TLS send %s, receive %s\n", SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+           tls_ktls_send[fd] ? "on" : "off", BIO_get_ktls_recv(SSL_get_rbio(ssl)) > 0 ? "on" : "off");
+}
+
+void tls_close(int fd) {
+    if (fd < 0 || fd >= TLS_MAX_FD || !tls_sessions[fd]) return;
+    SSL_shutdown(tls_sessions[fd]);
+    SSL_free(tls_sessions[fd]);
+    tls_sessions[fd] = NULL;
+    tls_ktls_send[fd] = 0;
+}
+
+// Decrypted bytes OpenSSL holds that select() cannot see.
+int tls_pending(int fd) {
+    return fd >= 0 && fd < TLS_MAX_FD && tls_sessions[fd] && SSL_pending(tls_sessions[fd]) > 0;
+}
+
 ssize_t send_all(int fd, const void *buf, size_t len) {
+    SSL *ssl = fd >= 0 && fd < TLS_MAX_FD && !tls_ktls_send[fd] ? tls_sessions[fd] : NULL;
     size_t total = 0;
     while (total < len) {
-        ssize_t n = send(fd, (char *)buf + total, len - total, 0);
+        size_t w = 0;
+        ssize_t n = ssl ? (SSL_write_ex(ssl, (char *)buf + total, len - total, &w) == 1 ? (ssize_t)w : -1)
+                        : send(fd, (char *)buf + total, len - total, 0);
         if (n <= 0) return n;
         total += n;
     }
     return total;
 }
 
+// Reads always go through OpenSSL when it owns the socket: with kernel TLS receive it
+// only collects the kernel-decrypted records, but it also handles non-data records.
 ssize_t recv_all(int fd, void *buf, size_t len) {
+    SSL *ssl = fd >= 0 && fd < TLS_MAX_FD ? tls_sessions[fd] : NULL;
     size_t total = 0;
     while (total < len) {
-        ssize_t n = recv(fd, (char *)buf + total, len - total, 0);
+        size_t got = 0;
+        ssize_t n = ssl ? (SSL_read_ex(ssl, (char *)buf + total, len - total, &got) == 1 ? (ssize_t)got : -1)
+                        : recv(fd, (char *)buf + total, len - total, 0);
         if (n <= 0) return n;
         total += n;
     }
     return total;
 }
 
+// CRC32C (Castagnoli). Software fallback is slicing-by-8; x86-64 uses the SSE4.2 crc32 instruction when present.
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    crc = ~crc;
+    while (len >= 8) {
+        uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]] ^ crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint64_t c = ~crc & 0xffffffffu;
+    while (len && ((uintptr_t)p & 7)) { c = _mm_crc32_u8(c, *p++); len--; }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) c = _mm_crc32_u8(c, *p++);
+    return ~(uint32_t)c;
+}
+#endif
+
+void init_checksums(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0x82F63B78u & -(c & 1));
+        crc32c_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+    crc32c = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) crc32c = crc32c_hw;
+#endif
+}
+
+// Whole-file checksum: CRC32C over the big-endian per-chunk CRCs, in order.
+uint32_t crc32c_chain(uint32_t file_crc, uint32_t chunk_crc) {
+    uint32_t be = htonl(chunk_crc);
+    return crc32c(file_crc, &be, sizeof(be));
+}
+
+void hash_run(HashJob *job, char *buf) {
+    uint32_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n) {
+        const ChunkSum *c = &job->sums[i];
+        ssize_t r = pread(job->fd, buf, c->len, c->offset);
+        job->out[i] = r == (ssize_t)c->len ? crc32c(0, buf, c->len) : ~c->crc;
+    }
+}
+
+// Hash workers are started once and sleep between jobs, each holding one pooled buffer.
+void *hash_worker(void *arg) {
+    (void)arg;
+    char *buf = buffer_get();
+    if (!buf) return NULL;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&hash_mutex);
+    for (;;) {
+        while (hash_generation == seen) pthread_cond_wait(&hash_work, &hash_mutex);
+        seen = hash_generation;
+        HashJob *job = hash_job;
+        if (!job) continue; // woke after that job already finished
+        job->active++;
+        pthread_mutex_unlock(&hash_mutex);
+        hash_run(job, buf);
+        pthread_mutex_lock(&hash_mutex);
+        if (--job->active == 0) pthread_cond_signal(&hash_done);
+    }
+    return NULL;
+}
+
+// Hash the listed ranges of fd into out[], spreading chunks over up to HASH_THREADS threads.
+void hash_chunks(int fd, const ChunkSum *sums, uint32_t n, uint32_t *out) {
+    HashJob job = { fd, sums, n, 0, out, 1 };
+    pthread_mutex_lock(&hash_mutex);
+    while (n > 1 && hash_threads < HASH_THREADS) {
+        pthread_t th;
+        if (pthread_create(&th, NULL, hash_worker, NULL) != 0) break;
+        pthread_detach(th);
+        hash_threads++;
+    }
+    if (n > 1 && hash_threads) {
+        hash_job = &job;
+        hash_generation++;
+        pthread_cond_broadcast(&hash_work);
+    }
+    pthread_mutex_unlock(&hash_mutex);
+    hash_run(&job, chunk_buf); // the caller's thread never sends while hashing, so chunk_buf is free
+    pthread_mutex_lock(&hash_mutex);
+    job.active--;
+    while (job.active > 0) pthread_cond_wait(&hash_done, &hash_mutex);
+    hash_job = NULL;
+    pthread_mutex_unlock(&hash_mutex);
+}
+
+// Slot for a node id in every version vector, added on first sight. -1 once VV_NODES are in use.
+int vv_slot(uint64_t node) {
+    pthread_mutex_lock(&vv_mutex);
+    int i = 0;
+    while (i < vv_node_count && vv_nodes[i] != node) i++;
+    if (i == vv_node_count) {
+        if (vv_node_count == VV_NODES) i = -1;
+        else vv_nodes[vv_node_count++] = node;
+    }
+    pthread_mutex_unlock(&vv_mutex);
+    return i;
+}
+
+// Nonzero if a counts an edit that b has not seen.
+int vv_newer(const VersionVector *a, const VersionVector *b) {
+    for (int i = 0; i < VV_NODES; i++)
+        if (a->c[i] > b->c[i]) return 1;
+    return 0;
+}
+
+void vv_merge(VersionVector *a, const VersionVector *b) {
+    for (int i = 0; i < VV_NODES; i++)
+        if (b->c[i] > a->c[i]) a->c[i] = b->c[i];
+}
+
+// Records st as the contents vv describes.
+void vv_settle(PathEntry *e, const struct stat *st) {
+    e->last_sent_mtime = st->st_mtime;
+    e->last_sent_size = st->st_size;
+    e->last_sent_nsec = st->st_mtim.tv_nsec;
+    e->last_sent_ino = st->st_ino;
+    state_dirty = 1;
+}
+
+// Contents that differ from what vv describes are a local edit: count it. The inode and
+// nanoseconds catch a replace within the same second as a received copy.
+void vv_note_local(PathEntry *e, const struct stat *st) {
+    if (!e) return;
+    if (e->last_sent_mtime == st->st_mtime && e->last_sent_size == st->st_size &&
+        (e->last_sent_nsec < 0 || e->last_sent_nsec == st->st_mtim.tv_nsec) &&
+        (!e->last_sent_ino || e->last_sent_ino == st->st_ino)) {
+        if (e->last_sent_nsec < 0 || !e->last_sent_ino) vv_settle(e, st);
+        return;
+    }
+    e->vv.c[0]++;
+    vv_settle(e, st);
+}
+
+// The peer now holds version v (or will once the message in flight lands).
+void vv_sent(PathEntry *e, const VersionVector *v) {
+    vv_merge(&e->peer_vv, v);
+    state_dirty = 1;
+}
+
+// A rename keeps the file's version history under its new name.
+void vv_rename(const char *old_rel, const char *new_rel) {
+    PathEntry *o = path_entry(old_rel, 0), *n = path_entry(new_rel, 1);
+    if (!o || !n) return;
+    n->vv = o->vv;
+    n->peer_vv = o->peer_vv;
+    n->last_sent_mtime = o->last_sent_mtime;
+    n->last_sent_size = o->last_sent_size;
+    n->last_sent_nsec = o->last_sent_nsec;
+    n->last_sent_ino = o->last_sent_ino;
+    memset(&o->vv, 0, sizeof(o->vv));
+    memset(&o->peer_vv, 0, sizeof(o->peer_vv));
+    o->last_sent_mtime = 0;
+    o->last_sent_size = 0;
+    state_dirty = 1;
+}
+
+// Only the nonzero counters travel, keyed by node id.
+void send_vv(int fd, const VersionVector *vv) {
+    uint8_t n = 0;
+    for (int i = 0; i < vv_node_count; i++) n += vv->c[i] != 0;
+    send_all(fd, &n, 1);
+    for (int i = 0; i < vv_node_count; i++) {
+        if (!vv->c[i]) continue;
+        uint64_t node = htobe64(vv_nodes[i]);
+        uint32_t c = htonl(vv->c[i]);
+        send_all(fd, &node, sizeof(node));
+        send_all(fd, &c, sizeof(c));
+    }
+}
+
+int recv_vv(int fd, VersionVector *vv) {
+    uint8_t n;
+    memset(vv, 0, sizeof(*vv));
+    if (recv_all(fd, &n, 1) <= 0) return -1;
+    for (int i = 0; i < n; i++) {
+        uint64_t node;
+        uint32_t c;
+        if (recv_all(fd, &node, sizeof(node)) <= 0 || recv_all(fd, &c, sizeof(c)) <= 0) return -1;
+        int slot = vv_slot(be64toh(node));
+        if (slot < 0) fprintf(stderr, "Warning: more than %d peers in a version vector, ignoring one\n", VV_NODES);
+        else vv->c[slot] = ntohl(c);
+    }
+    return 0;
+}
+
 void send_rename(const char *old_path, const char *new_path, int fd) {
-    char old_rel[MAX_PATH], new_rel[MAX_PATH];
-    if (get_relative_path(old_path, old_rel, sizeof(old_rel)) < 0) return;
-    if (get_relative_path(new_path, new_rel, sizeof(new_rel)) < 0) return;
+    const char *old_rel = rel_of(old_path), *new_rel = rel_of(new_path);
+    if (!old_rel || !new_rel) return;
     uint8_t msg_type = MSG_TYPE_FILE_RENAME;
     uint32_t oldlen = htonl(strlen(old_rel));
     uint32_t newlen = htonl(strlen(new_rel));
@@ -145,13 +992,14 @@ void send_rename(const char *old_path, const char *new_path, int fd) {
     send_all(fd, old_rel, strlen(old_rel));
     send_all(fd, &newlen, sizeof(newlen));
     send_all(fd, new_rel, strlen(new_rel));
+    vv_rename(old_rel, new_rel);
     log_event("CLIENT->SERVER", "Renamed", old_rel, new_rel);
     printf("? Rename sent: %s -> %s\n", old_rel, new_rel);
 }
 
 void send_delete(const char *path, int fd) {
-    char rel_path[MAX_PATH];
-    if (get_relative_path(path, rel_path, sizeof(rel_path)) < 0) return;
+    const char *rel_path = rel_of(path);
+    if (!rel_path) return;
     uint8_t msg_type = MSG_TYPE_FILE_DELETE;
     uint32_t nl = htonl(strlen(rel_path));
     send_all(fd, &msg_type, 1);
@@ -161,219 +1009,1649 @@ void send_delete(const char *path, int fd) {
     printf("? Deleted sent: %s\n", rel_path);
 }
 
-void send_file(const char *path, int fd) {
-    char rel_path[MAX_PATH];
-    if (get_relative_path(path, rel_path, sizeof(rel_path)) < 0) return;
+void bucket_set_rate(TokenBucket *b, uint64_t rate) {
+    if (b->rate == rate) return;
+    b->rate = rate;
+    b->tokens = 0;
+    clock_gettime(CLOCK_MONOTONIC, &b->last);
+}
+
+// Charge n bytes to the bucket, sleeping off any deficit. Burst is capped at one second of traffic.
+// Serialised so seed senders on several connections share one budget.
+void bucket_take(TokenBucket *b, size_t n) {
+    if (b->rate == 0) return;
+    pthread_mutex_lock(&rate_mutex);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - b->last.tv_sec) + (now.tv_nsec - b->last.tv_nsec) / 1e9;
+    b->last = now;
+    b->tokens += elapsed * b->rate;
+    if (b->tokens > b->rate) b->tokens = b->rate;
+    b->tokens -= n;
+    if (b->tokens < 0) usleep((useconds_t)(-b->tokens * 1e6 / b->rate));
+    pthread_mutex_unlock(&rate_mutex);
+}
+
+uint64_t scheduled_rate(void) {
     time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    for (int i = 0; i < rate_window_count; i++) {
+        if (tm.tm_hour >= rate_schedule[i].start_hour && tm.tm_hour < rate_schedule[i].end_hour)
+            return rate_schedule[i].bps;
+    }
+    return global_rate;
+}
 
-    pthread_mutex_lock(&recent_recv_mutex);
-    for (int i = 0; i < recent_count; i++) {
-        if (strcmp(recently_received[i].filename, path) == 0 && now - recently_received[i].received_time <= 5) {
-            pthread_mutex_unlock(&recent_recv_mutex);
-            return;
+void setup_rate_limits(const char *peer_ip) {
+    bucket_set_rate(&global_bucket, scheduled_rate());
+    for (int i = 0; i < peer_rate_count; i++) {
+        if (fnmatch(peer_rates[i].ip, peer_ip, 0) == 0) {
+            if (peer_rates[i].bps) printf("? Peer %s limited to %llu bytes/s\n", peer_ip, (unsigned long long)peer_rates[i].bps);
+            bucket_set_rate(&peer_bucket, peer_rates[i].bps);
+            break;
         }
     }
-    pthread_mutex_unlock(&recent_recv_mutex);
+}
 
-    struct stat st;
-    if (stat(path, &st) < 0) return;
+// Bytes per second, with an optional K, M or G suffix (powers of 1024). -1 if malformed.
+int parse_rate(const char *s, uint64_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (end == s || errno || *s == '-') return -1;
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    }
+    if (*end) return -1;
+    *out = v;
+    return 0;
+}
+
+// "IP=BPS", or just "BPS" for any peer.
+int add_peer_rate(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    uint64_t bps;
+    if (peer_rate_count == MAX_RATE_RULES || parse_rate(eq ? eq + 1 : spec, &bps) < 0) return -1;
+    peer_rates[peer_rate_count].ip = eq ? strndup(spec, eq - spec) : "*";
+    peer_rates[peer_rate_count++].bps = bps;
+    return 0;
+}
+
+// One rule per line; blank lines and lines starting with '#' are skipped:
+//   rate START-END BPS        global budget for local hours [START, END)
+//   peer IP BPS               cap for peers whose address matches IP (a glob)
+//   priority PATTERN urgent|normal|bulk
+int load_rate_file(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    char line[MAX_PATH], kind[16], a[MAX_PATH], b[64];
+    int n = 0, lineno = 0, bad = 0;
+    while (!bad && fgets(line, sizeof(line), f)) {
+        lineno++;
+        int fields = sscanf(line, "%15s %2047s %63s", kind, a, b);
+        if (fields <= 0 || kind[0] == '#') continue;
+        int start, end, endpos = 0;
+        uint64_t bps;
+        if (fields < 3) bad = 1;
+        else if (strcmp(kind, "rate") == 0) {
+            bad = rate_window_count == MAX_RATE_RULES || sscanf(a, "%d-%d%n", &start, &end, &endpos) != 2 || a[endpos] ||
+                  start < 0 || end > 24 || start >= end || parse_rate(b, &bps) < 0;
+            if (!bad) rate_schedule[rate_window_count++] = (RateWindow){ start, end, bps };
+        } else if (strcmp(kind, "peer") == 0) {
+            bad = peer_rate_count == MAX_RATE_RULES || parse_rate(b, &bps) < 0;
+            if (!bad) peer_rates[peer_rate_count++] = (PeerRate){ strdup(a), bps };
+        } else if (strcmp(kind, "priority") == 0) {
+            int prio = strcmp(b, "urgent") == 0 ? PRIO_URGENT : strcmp(b, "normal") == 0 ? PRIO_NORMAL :
+                       strcmp(b, "bulk") == 0 ? PRIO_BULK : -1;
+            bad = priority_rule_count == MAX_RATE_RULES || prio < 0;
+            if (!bad) priority_rules[priority_rule_count++] = (PriorityRule){ strdup(a), prio };
+        } else bad = 1;
+        n += !bad;
+    }
+    fclose(f);
+    if (bad) {
+        fprintf(stderr, "%s:%d: bad rule: %s", path, lineno, line);
+        return -1;
+    }
+    printf("? Loaded %d rate rules from %s\n", n, path);
+    return 0;
+}
+
+// send_all() for file payload: paced by the global and per-peer token buckets.
+ssize_t send_paced(int fd, const void *buf, size_t len) {
+    bucket_set_rate(&global_bucket, scheduled_rate());
+    size_t total = 0;
+    while (total < len) {
+        size_t n = len - total < BUFSIZE ? len - total : BUFSIZE;
+        if (!global_bucket.rate && !peer_bucket.rate) n = len - total; // unthrottled: one send
+        bucket_take(&global_bucket, n);
+        bucket_take(&peer_bucket, n);
+        ssize_t r = send_all(fd, (char *)buf + total, n);
+        if (r <= 0) return r;
+        total += r;
+    }
+    return total;
+}
+
+// Copies mapped bytes out with the SIGBUS guard armed. If the file was truncated under us
+// the copy reads as zeros, and the chunk CRC already sent makes the receiver ask again.
+void source_copy(SourceFile *src, off_t offset, size_t len, void *buf) {
+    sigbus_armed = 1;
+    if (sigsetjmp(sigbus_jmp, 1) == 0) memcpy(buf, src->map + offset, len);
+    else memset(buf, 0, len);
+    sigbus_armed = 0;
+}
 
-    pthread_mutex_lock(&file_track_mutex);
-    for (int i = 0; i < tracked_count; i++) {
-        if (strcmp(tracked_files[i].filename, path) == 0 && tracked_files[i].last_sent_mtime == st.st_mtime) {
-            pthread_mutex_unlock(&file_track_mutex);
-            return;
+// File payload that source_read() returned. When it came from the mapping and the kernel
+// does the TLS encryption, send it from the page cache instead of through OpenSSL. When
+// OpenSSL encrypts, mapped data goes through chunk_buf first: a fault on a truncated file
+// inside SSL_write_ex() could not be recovered from. Plain send() just fails with EFAULT.
+ssize_t send_source(int fd, SourceFile *src, off_t offset, const void *data, size_t len) {
+    int mapped = src && src->map && data == src->map + offset;
+    SSL *ssl = fd >= 0 && fd < TLS_MAX_FD ? tls_sessions[fd] : NULL;
+    if (mapped && ssl && !tls_ktls_send[fd]) {
+        size_t total = 0;
+        while (total < len) {
+            size_t n = len - total < CHUNK_SIZE ? len - total : CHUNK_SIZE;
+            source_copy(src, offset + total, n, chunk_buf);
+            ssize_t r = send_paced(fd, chunk_buf, n);
+            if (r <= 0) return r;
+            total += r;
         }
+        return total;
+    }
+    if (!mapped || !ssl) return send_paced(fd, data, len);
+    bucket_set_rate(&global_bucket, scheduled_rate());
+    size_t total = 0;
+    while (total < len) {
+        size_t n = len - total < BUFSIZE ? len - total : BUFSIZE;
+        if (!global_bucket.rate && !peer_bucket.rate) n = len - total;
+        bucket_take(&global_bucket, n);
+        bucket_take(&peer_bucket, n);
+        ossl_ssize_t r = SSL_sendfile(ssl, src->fd, offset + total, n, 0);
+        if (r <= 0) return r;
+        total += r;
     }
-    pthread_mutex_unlock(&file_track_mutex);
+    return total;
+}
 
-    FILE *f = fopen(path, "rb");
-    if (!f) return;
+// Attributes as last sent or applied. ctime covers changes (xattrs) not otherwise recorded.
+void remember_meta(PathEntry *e, const struct stat *st) {
+    if (!e) return;
+    e->last_mode = st->st_mode;
+    e->last_uid = st->st_uid;
+    e->last_gid = st->st_gid;
+    e->last_mtim = st->st_mtim;
+    e->last_ctim = st->st_ctim;
+}
 
-    uint8_t msg_type = MSG_TYPE_FILE_SEND;
-    send_all(fd, &msg_type, 1);
+int meta_synced(const PathEntry *e, const struct stat *st) {
+    return e->last_mode == st->st_mode && e->last_uid == st->st_uid && e->last_gid == st->st_gid &&
+           e->last_mtim.tv_sec == st->st_mtim.tv_sec && e->last_mtim.tv_nsec == st->st_mtim.tv_nsec &&
+           e->last_ctim.tv_sec == st->st_ctim.tv_sec && e->last_ctim.tv_nsec == st->st_ctim.tv_nsec;
+}
 
-    uint32_t nl = htonl(strlen(rel_path));
-    uint64_t fs = htobe64(st.st_size);
-    send_all(fd, &nl, sizeof(nl));
-    send_all(fd, rel_path, strlen(rel_path));
-    send_all(fd, &fs, sizeof(fs));
-    send_all(fd, &st.st_mode, sizeof(st.st_mode));
-    struct utimbuf ut = {st.st_atime, st.st_mtime};
-    send_all(fd, &ut, sizeof(ut));
+int is_incoming(const char *full) {
+    for (int i = 0; i < incoming_count; i++)
+        if (strcmp(incoming[i].full, full) == 0) return 1;
+    return 0;
+}
 
-    char buf[BUFSIZE];
-    size_t n;
-    while ((n = fread(buf, 1, BUFSIZE, f)) > 0) send_all(fd, buf, n);
-    fclose(f);
+// Nonzero if the peer already holds this version of path, or path is being written by it.
+int already_synced(const char *path, const struct stat *st) {
+    if (is_incoming(path)) return 1;
+    PathEntry *e = path_entry(rel_of(path), 1);
+    if (!e) return 0;
+    vv_note_local(e, st);
+    if (vv_newer(&e->vv, &e->peer_vv)) return 0;
+    // Baseline for later rescans, which compare attributes against it
+    if (!e->last_ctim.tv_sec) remember_meta(e, st);
+    return 1;
+}
 
-    log_event("CLIENT->SERVER", "Sent", rel_path, NULL);
-    printf("? Sent: %s\n", rel_path);
-
-    pthread_mutex_lock(&file_track_mutex);
-    if (tracked_count < MAX_TRACKED_FILES) {
-        strcpy(tracked_files[tracked_count].filename, path);
-        tracked_files[tracked_count].last_sent_mtime = st.st_mtime;
-        tracked_count++;
-    }
-    pthread_mutex_unlock(&file_track_mutex);
-}
-
-void poll_files(int fd, const char *dir, const char *prefix) {
-    DIR *d = opendir(dir);
-    if (!d) return;
-    struct dirent *e;
-    char rel[MAX_PATH];
-    while ((e = readdir(d))) {
-        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
-        char path[MAX_PATH];
-        int ret = snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
-        if (ret < 0 || ret >= (int)sizeof(path)) {
-            fprintf(stderr, "Warning: path too long and truncated: %s/%s\n", dir, e->d_name);
-            continue;
+void remember_sent(PathEntry *e, time_t mtime, off_t size) {
+    if (!e) return;
+    if (e->last_sent_mtime != mtime || e->last_sent_size != size) {
+        e->last_sent_nsec = -1;
+        e->last_sent_ino = 0;
+    }
+    e->last_sent_mtime = mtime;
+    e->last_sent_size = size;
+    e->modified = 0;
+    state_dirty = 1;
+}
+
+// A mapped source truncated underneath us faults on access; bail out of the read instead of dying.
+void on_sigbus(int sig) {
+    if (sigbus_armed) siglongjmp(sigbus_jmp, 1);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+int source_open(SourceFile *src, const char *path, off_t size) {
+    memset(src, 0, sizeof(*src));
+    src->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (src->fd < 0) return -1;
+    src->size = size;
+    if (size > 0 && (read_strategy == READ_MMAP || (read_strategy == READ_AUTO && size > MMAP_THRESHOLD))) {
+        void *m = mmap(NULL, size, PROT_READ, MAP_SHARED, src->fd, 0);
+        if (m != MAP_FAILED) {
+            src->map = m;
+            madvise(m, size, MADV_SEQUENTIAL);
         }
-        if (e->d_type == DT_DIR) {
-            char nprefix[MAX_PATH];
-            ret = snprintf(nprefix, sizeof(nprefix), "%s%s/", prefix, e->d_name);
-            if (ret < 0 || ret >= (int)sizeof(nprefix)) {
-                fprintf(stderr, "Warning: prefix too long and truncated\n");
-                continue;
-            }
-            poll_files(fd, path, nprefix);
-        } else if (e->d_type == DT_REG) {
-            ret = snprintf(rel, sizeof(rel), "%s%s", prefix, e->d_name);
-            if (ret < 0 || ret >= (int)sizeof(rel)) {
-                fprintf(stderr, "Warning: relative path too long and truncated\n");
-                continue;
-            }
-            char full[MAX_PATH];
-            ret = snprintf(full, sizeof(full), "%s/%s", WATCH_DIR, rel);
-            if (ret < 0 || ret >= (int)sizeof(full)) {
-                fprintf(stderr, "Warning: full path too long and truncated\n");
-                continue;
+    }
+    return 0;
+}
+
+// Returns len bytes at offset, straight from the mapping when there is one, else copied into buf.
+// Bytes past the current end of file read as zeros. *crc receives the CRC32C of the returned bytes.
+const void *source_read(SourceFile *src, off_t offset, size_t len, void *buf, uint32_t *crc) {
+    if (src->map) {
+        struct stat st;
+        if (fstat(src->fd, &st) == 0 && st.st_size >= offset + (off_t)len) {
+            sigbus_armed = 1;
+            if (sigsetjmp(sigbus_jmp, 1) == 0) {
+                *crc = crc32c(0, src->map + offset, len);
+                sigbus_armed = 0;
+                return src->map + offset;
             }
-            send_file(full, fd);
+            sigbus_armed = 0;
         }
     }
-    closedir(d);
-    usleep(500000);
+    size_t n = 0;
+    ssize_t got;
+    while (n < len && (got = pread(src->fd, (char *)buf + n, len - n, offset + n)) > 0) n += got;
+    memset((char *)buf + n, 0, len - n);
+    *crc = crc32c(0, buf, len);
+    return buf;
 }
 
-void receive_delete(int fd) {
-    uint32_t nl;
-    if (recv_all(fd, &nl, sizeof(nl)) <= 0) return;
-    nl = ntohl(nl);
-    char fn[MAX_PATH];
-    if (recv_all(fd, fn, nl) <= 0) return;
-    fn[nl] = 0;
-    char full[MAX_PATH];
-    int ret = snprintf(full, sizeof(full), "%s/%s", WATCH_DIR, fn);
-    if (ret < 0 || ret >= (int)sizeof(full)) {
-        fprintf(stderr, "Warning: full path truncation on delete\n");
+// Drop pages the send cursor has passed so a bulk sync does not push hot data out of the page cache.
+void source_drop_behind(SourceFile *src, off_t offset) {
+    if (offset - src->dropped < DROP_BEHIND && offset < src->size) return;
+    if (src->map) madvise(src->map + src->dropped, offset - src->dropped, MADV_DONTNEED);
+    posix_fadvise(src->fd, src->dropped, offset - src->dropped, POSIX_FADV_DONTNEED);
+    src->dropped = offset;
+}
+
+void source_close(SourceFile *src) {
+    if (src->map) munmap(src->map, src->size);
+    if (src->fd >= 0) close(src->fd);
+    memset(src, 0, sizeof(*src));
+    src->fd = -1;
+}
+
+void send_file_header(int fd, uint8_t msg_type, const PathEntry *e, const struct stat *st) {
+    send_all(fd, &msg_type, 1);
+    uint32_t nl = htonl(strlen(e->rel));
+    uint64_t fs = htobe64(st->st_size);
+    send_all(fd, &nl, sizeof(nl));
+    send_all(fd, e->rel, strlen(e->rel));
+    send_all(fd, &fs, sizeof(fs));
+    send_all(fd, &st->st_mode, sizeof(st->st_mode));
+    struct utimbuf ut = {st->st_atime, st->st_mtime};
+    send_all(fd, &ut, sizeof(ut));
+    send_vv(fd, &e->vv);
+}
+
+int transfer_priority(const char *rel_path, off_t size) {
+    for (int i = 0; i < priority_rule_count; i++)
+        if (fnmatch(priority_rules[i].pattern, rel_path, 0) == 0) return priority_rules[i].priority;
+    for (size_t i = 0; i < sizeof(default_priority_rules) / sizeof(default_priority_rules[0]); i++)
+        if (fnmatch(default_priority_rules[i].pattern, rel_path, 0) == 0) return default_priority_rules[i].priority;
+    return size > LARGE_FILE_THRESHOLD ? PRIO_BULK : PRIO_NORMAL;
+}
+
+void dequeue_transfer(int i) {
+    pending[i].entry->queued = 0;
+    pending[i] = pending[--pending_count];
+    if (i < pending_count) pending[i].entry->queued = i + 1;
+}
+
+void enqueue_transfer(const char *path) {
+    const char *rel_path = rel_of(path);
+    if (!rel_path) return;
+    if (is_temp_name(rel_path)) return;
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) return;
+    if (already_synced(path, &st)) return;
+    PathEntry *e = path_entry(rel_path, 1);
+    if (!e) return;
+    for (int i = 0; i < outgoing_count; i++)
+        if (outgoing[i].entry == e && outgoing[i].mtime == st.st_mtime) return;
+
+    int prio = transfer_priority(e->rel, st.st_size);
+    if (e->queued) {
+        pending[e->queued - 1].size = st.st_size;
+        pending[e->queued - 1].priority = prio;
         return;
     }
-    if (unlink(full) == 0) {
-        log_event("SERVER->CLIENT", "Deleted", fn, NULL);
-        printf("? Deleted received: %s\n", fn);
+    if (pending_count >= MAX_PENDING) {
+        fprintf(stderr, "Warning: transfer queue full, deferring %s\n", e->rel);
+        return;
     }
-    sleep(1);
+    pending[pending_count] = (PendingTransfer){ e, st.st_size, prio };
+    e->queued = ++pending_count;
 }
 
-void receive_rename(int fd) {
-    uint32_t olen, nlen;
-    if (recv_all(fd, &olen, sizeof(olen)) <= 0) return;
-    olen = ntohl(olen);
-    char oldrel[MAX_PATH];
-    if (recv_all(fd, oldrel, olen) <= 0) return;
-    oldrel[olen] = 0;
-    if (recv_all(fd, &nlen, sizeof(nlen)) <= 0) return;
-    nlen = ntohl(nlen);
-    char newrel[MAX_PATH];
-    if (recv_all(fd, newrel, nlen) <= 0) return;
-    newrel[nlen] = 0;
-
-    char fullold[MAX_PATH], fullnew[MAX_PATH];
-    int ret1 = snprintf(fullold, sizeof(fullold), "%s/%s", WATCH_DIR, oldrel);
-    int ret2 = snprintf(fullnew, sizeof(fullnew), "%s/%s", WATCH_DIR, newrel);
-    if (ret1 < 0 || ret1 >= (int)sizeof(fullold) || ret2 < 0 || ret2 >= (int)sizeof(fullnew)) {
-        fprintf(stderr, "Warning: full path truncation on rename\n");
+void send_file(PathEntry *e, int fd) {
+    if (full_path(e, xfer_path, sizeof(xfer_path)) < 0) return;
+    struct stat st;
+    if (stat(xfer_path, &st) < 0) return;
+    if (already_synced(xfer_path, &st)) return;
+    if (st.st_size > LARGE_FILE_THRESHOLD) {
+        // Grew past the inline limit since it was queued; requeue so it goes out as a stream.
+        enqueue_transfer(xfer_path);
         return;
     }
 
-    char fullnew_copy[MAX_PATH];
-    snprintf(fullnew_copy, sizeof(fullnew_copy), "%s", fullnew);
-    ensure_dir(dirname(fullnew_copy));
+    SourceFile src;
+    if (source_open(&src, xfer_path, st.st_size) < 0) return;
 
-    if (rename(fullold, fullnew) == 0) {
-        log_event("SERVER->CLIENT", "Renamed", oldrel, newrel);
-        printf("? Rename received: %s -> %s\n", oldrel, newrel);
+    uint32_t nchunks = (st.st_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    uint32_t crcs[LARGE_FILE_THRESHOLD / CHUNK_SIZE + 1];
+    send_file_header(fd, MSG_TYPE_FILE_SEND, e, &st);
+    off_t sent = 0;
+    uint32_t file_crc = 0;
+    // Exactly st_size bytes go out even if the file changes underneath; a later event resends it.
+    for (uint32_t i = 0; i < nchunks; i++) {
+        size_t want = st.st_size - sent < CHUNK_SIZE ? st.st_size - sent : CHUNK_SIZE;
+        const void *data = source_read(&src, sent, want, chunk_buf, &crcs[i]);
+        send_source(fd, &src, sent, data, want);
+        file_crc = crc32c_chain(file_crc, crcs[i]);
+        sent += want;
     }
-}
+    source_close(&src);
+    uint32_t be = htonl(nchunks);
+    send_all(fd, &be, sizeof(be));
+    for (uint32_t i = 0; i < nchunks; i++) {
+        be = htonl(crcs[i]);
+        send_all(fd, &be, sizeof(be));
+    }
+    be = htonl(file_crc);
+    send_all(fd, &be, sizeof(be));
+    log_event("CLIENT->SERVER", "Sent", e->rel, NULL);
+    printf("? Sent: %s\n", e->rel);
 
-void receive_message(int fd) {
-    uint8_t msg_type;
-    ssize_t r = recv_all(fd, &msg_type, 1);
-    if (r <= 0) return;
-    switch (msg_type) {
-    case MSG_TYPE_FILE_SEND: {
-        uint32_t nl;
-        if (recv_all(fd, &nl, sizeof(nl)) <= 0) return;
-        nl = ntohl(nl);
-        char fn[MAX_PATH];
-        if (recv_all(fd, fn, nl) <= 0) return;
-        fn[nl] = 0;
-        uint64_t fs;
-        if (recv_all(fd, &fs, sizeof(fs)) <= 0) return;
-        fs = be64toh(fs);
-        mode_t pm;
-        if (recv_all(fd, &pm, sizeof(pm)) <= 0) return;
-        struct utimbuf ut;
-        if (recv_all(fd, &ut, sizeof(ut)) <= 0) return;
-        char full[MAX_PATH];
-        int ret = snprintf(full, sizeof(full), "%s/%s", WATCH_DIR, fn);
-        if (ret < 0 || ret >= (int)sizeof(full)) {
-            fprintf(stderr, "Warning: full path truncation on receive\n");
-            return;
-        }
+    remember_sent(e, st.st_mtime, st.st_size);
+    vv_sent(e, &e->vv);
+    remember_meta(e, &st);
+}
 
-        char full_copy[MAX_PATH];
-        snprintf(full_copy, sizeof(full_copy), "%s", full);
-        ensure_dir(dirname(full_copy));
+// Local fast path: announce the file; the peer copies it from our directory itself.
+void send_local(PathEntry *e, int fd) {
+    if (full_path(e, xfer_path, sizeof(xfer_path)) < 0) return;
+    struct stat st;
+    if (stat(xfer_path, &st) < 0) return;
+    if (already_synced(xfer_path, &st)) return;
+    send_file_header(fd, MSG_TYPE_FILE_LOCAL, e, &st);
+    log_event("CLIENT->SERVER", "Sent", e->rel, NULL);
+    printf("? Sent (local): %s\n", e->rel);
+    remember_sent(e, st.st_mtime, st.st_size);
+    vv_sent(e, &e->vv);
+    remember_meta(e, &st);
+}
 
-        FILE *f = fopen(full, "wb");
-        if (!f) return;
-        size_t got = 0;
-        char buf[BUFSIZE];
+// Data extents of an open file via SEEK_DATA/SEEK_HOLE, into *out (grown as needed and
+// kept by the caller for reuse). Filesystems without hole reporting give one extent.
+int map_extents(int fd, off_t size, Extent **out, uint32_t *cap, uint32_t *count) {
+    uint32_t n = 0;
+    off_t pos = 0;
+    while (pos < size) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) break;
+            data = pos;
+        }
+        if (data >= size) break;
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > size) hole = size;
+        if (n == *cap) {
+            uint32_t ncap = *cap ? *cap * 2 : 8;
+            Extent *e = counted_realloc(*out, ncap * sizeof(Extent));
+            if (!e) return -1;
+            *out = e;
+            *cap = ncap;
+        }
+        (*out)[n++] = (Extent){ data, hole - data };
+        pos = hole;
+    }
+    *count = n;
+    return 0;
+}
+
+void begin_stream(PathEntry *e, int fd) {
+    OutgoingStream *s = &outgoing[outgoing_count];
+    if (full_path(e, xfer_path, sizeof(xfer_path)) < 0) return;
+    struct stat st;
+    if (stat(xfer_path, &st) < 0) return;
+    if (already_synced(xfer_path, &st)) return;
+    if (source_open(&s->src, xfer_path, st.st_size) < 0) return;
+    if (map_extents(s->src.fd, st.st_size, &s->ext, &s->ext_cap, &s->next) < 0) {
+        source_close(&s->src);
+        return;
+    }
+
+    s->entry = e;
+    s->size = st.st_size;
+    s->offset = 0;
+    s->mtime = st.st_mtime;
+    s->vv = e->vv;
+    s->priority = transfer_priority(e->rel, st.st_size);
+    s->nchunks = 0;
+    s->file_crc = 0;
+    s->cur = 0;
+    outgoing_count++;
+    send_file_header(fd, MSG_TYPE_FILE_BEGIN, e, &st);
+
+    off_t data = 0;
+    uint32_t ne = htonl(s->next);
+    send_all(fd, &ne, sizeof(ne));
+    for (uint32_t i = 0; i < s->next; i++) {
+        uint64_t eo = htobe64(s->ext[i].offset), el = htobe64(s->ext[i].len);
+        send_all(fd, &eo, sizeof(eo));
+        send_all(fd, &el, sizeof(el));
+        data += s->ext[i].len;
+    }
+    if (s->next) s->offset = s->ext[0].offset;
+    printf("? Streaming: %s (%lld bytes, %lld in %u extents)\n", e->rel, (long long)st.st_size,
+           (long long)data, s->next);
+}
+
+// Frees stream idx by swapping the last one into its slot; slots keep their extent buffers.
+void release_stream(int idx) {
+    OutgoingStream *s = &outgoing[idx];
+    source_close(&s->src);
+    OutgoingStream done = *s;
+    *s = outgoing[--outgoing_count];
+    outgoing[outgoing_count].ext = done.ext;
+    outgoing[outgoing_count].ext_cap = done.ext_cap;
+}
+
+void end_stream(int idx, int fd) {
+    OutgoingStream *s = &outgoing[idx];
+    const char *rel = s->entry->rel;
+    uint8_t msg_type = MSG_TYPE_FILE_END;
+    uint32_t nl = htonl(strlen(rel));
+    uint32_t nc = htonl(s->nchunks);
+    uint32_t fc = htonl(s->file_crc);
+    send_all(fd, &msg_type, 1);
+    send_all(fd, &nl, sizeof(nl));
+    send_all(fd, rel, strlen(rel));
+    send_all(fd, &nc, sizeof(nc));
+    send_all(fd, &fc, sizeof(fc));
+    log_event("CLIENT->SERVER", "Sent", rel, NULL);
+    printf("? Sent: %s\n", rel);
+    remember_sent(s->entry, s->mtime, s->size);
+    vv_sent(s->entry, &s->vv);
+    release_stream(idx);
+}
+
+void send_chunk(int fd, const char *rel, uint64_t offset, const void *data, uint32_t len, uint32_t crc, SourceFile *src) {
+    uint8_t msg_type = MSG_TYPE_FILE_CHUNK;
+    uint32_t nl = htonl(strlen(rel));
+    uint64_t off = htobe64(offset);
+    uint32_t cl = htonl(len);
+    uint32_t cc = htonl(crc);
+    send_all(fd, &msg_type, 1);
+    send_all(fd, &nl, sizeof(nl));
+    send_all(fd, rel, strlen(rel));
+    send_all(fd, &off, sizeof(off));
+    send_all(fd, &cl, sizeof(cl));
+    send_all(fd, &cc, sizeof(cc));
+    send_source(fd, src, offset, data, len);
+}
+
+// Send one chunk of a large file. Streams yield to the scheduler between chunks
+// and only ever cover data extents, so holes cost nothing on the wire.
+void send_next_chunk(int idx, int fd) {
+    OutgoingStream *s = &outgoing[idx];
+    while (s->cur < s->next && s->offset >= s->ext[s->cur].offset + s->ext[s->cur].len)
+        if (++s->cur < s->next) s->offset = s->ext[s->cur].offset;
+    if (s->cur >= s->next) {
+        end_stream(idx, fd);
+        return;
+    }
+    off_t left = s->ext[s->cur].offset + s->ext[s->cur].len - s->offset;
+    size_t want = left < CHUNK_SIZE ? left : CHUNK_SIZE;
+    if (want > 0) {
+        uint32_t crc;
+        const void *data = source_read(&s->src, s->offset, want, chunk_buf, &crc);
+        send_chunk(fd, s->entry->rel, s->offset, data, want, crc, &s->src);
+        s->file_crc = crc32c_chain(s->file_crc, crc);
+        s->nchunks++;
+        s->offset += want;
+        source_drop_behind(&s->src, s->offset);
+    }
+}
+
+// One scheduling step: the most urgent (then smallest) queued file, or one chunk of the most urgent stream.
+void run_transfers(int fd) {
+    int best = -1, stream = -1;
+    for (int i = 0; i < pending_count; i++) {
+        if (best < 0 || pending[i].priority < pending[best].priority ||
+            (pending[i].priority == pending[best].priority && pending[i].size < pending[best].size))
+            best = i;
+    }
+    for (int i = 0; i < outgoing_count; i++)
+        if (stream < 0 || outgoing[i].priority < outgoing[stream].priority) stream = i;
+
+    if (best >= 0 && (stream < 0 || pending[best].priority <= outgoing[stream].priority) &&
+        (local_peer || pending[best].size <= LARGE_FILE_THRESHOLD || outgoing_count < MAX_STREAMS)) {
+        PendingTransfer job = pending[best];
+        dequeue_transfer(best);
+        if (local_peer) send_local(job.entry, fd);
+        else if (job.size > LARGE_FILE_THRESHOLD) begin_stream(job.entry, fd);
+        else send_file(job.entry, fd);
+        return;
+    }
+    if (stream >= 0) send_next_chunk(stream, fd);
+}
+
+void dequeue_meta(int i) {
+    meta_pending[i].entry->meta_queued = 0;
+    meta_pending[i] = meta_pending[--meta_count];
+    if (i < meta_count) meta_pending[i].entry->meta_queued = i + 1;
+}
+
+// Settle queued work for a path before a delete or rename of it goes out.
+void flush_transfers(const char *path, int fd) {
+    PathEntry *e = path_entry(rel_of(path), 0);
+    if (!e) return;
+    if (e->queued) dequeue_transfer(e->queued - 1);
+    if (e->meta_queued) dequeue_meta(e->meta_queued - 1);
+    for (int i = 0; i < outgoing_count; i++)
+        if (outgoing[i].entry == e) end_stream(i--, fd);
+}
+
+// Attribute-only change to a file the peer already has: queue a metadata update
+// instead of the contents. The caller keeps meta_count below MAX_PENDING.
+void enqueue_meta(PathEntry *e, const char *path) {
+    struct stat st;
+    if (e->queued || e->meta_queued) return; // a queued full send carries the attributes anyway
+    if (lstat(path, &st) < 0 || !S_ISREG(st.st_mode) || is_incoming(path) || meta_synced(e, &st)) return;
+    if (st.st_size != e->last_sent_size) {
+        enqueue_transfer(path);
+        return;
+    }
+    meta_pending[meta_count].entry = e;
+    e->meta_queued = ++meta_count;
+    clock_gettime(CLOCK_MONOTONIC, &meta_last);
+}
+
+// Queued updates go out once META_DELAY_MS pass without another, or the queue is full.
+int meta_ready(void) {
+    struct timespec now;
+    if (!meta_count) return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return meta_count == MAX_PENDING ||
+           (now.tv_sec - meta_last.tv_sec) * 1000 + (now.tv_nsec - meta_last.tv_nsec) / 1000000 >= META_DELAY_MS;
+}
+
+// inotify dispatch: writes, creates and moves need the data; attribute events
+// (chmod, chown, touch, xattrs) on a file not written since its last sync do not.
+void enqueue_change(const char *path, uint32_t mask) {
+    PathEntry *e = path_entry(rel_of(path), 0);
+    if (mask & (IN_MODIFY | IN_CREATE | IN_MOVED_TO)) {
+        if (e) e->modified = 1;
+        enqueue_transfer(path);
+    } else if (e && !e->modified && e->last_sent_mtime) {
+        enqueue_meta(e, path);
+    } else {
+        enqueue_transfer(path);
+    }
+}
+
+// Orders by parent directory, then name, so each directory's updates are adjacent.
+int meta_order(const void *a, const void *b) {
+    const char *x = ((const MetaUpdate *)a)->entry->rel, *y = ((const MetaUpdate *)b)->entry->rel;
+    const char *xs = strrchr(x, '/'), *ys = strrchr(y, '/');
+    size_t xl = xs ? (size_t)(xs - x) : 0, yl = ys ? (size_t)(ys - y) : 0;
+    int c = memcmp(x, y, xl < yl ? xl : yl);
+    if (c == 0 && xl != yl) c = xl < yl ? -1 : 1;
+    return c ? c : strcmp(x + xl, y + yl);
+}
+
+void send_meta_entry(int fd, MetaUpdate *m, size_t skip) {
+    const char *name = m->entry->rel + skip;
+    const struct stat *st = &m->st;
+    uint32_t nl = htonl(strlen(name)), mode = htonl(st->st_mode), uid = htonl(st->st_uid), gid = htonl(st->st_gid);
+    uint64_t size = htobe64(st->st_size), asec = htobe64(st->st_atim.tv_sec), msec = htobe64(st->st_mtim.tv_sec);
+    uint32_t ansec = htonl(st->st_atim.tv_nsec), mnsec = htonl(st->st_mtim.tv_nsec);
+    send_all(fd, &nl, sizeof(nl));
+    send_all(fd, name, strlen(name));
+    send_all(fd, &size, sizeof(size));
+    send_all(fd, &mode, sizeof(mode));
+    send_all(fd, &uid, sizeof(uid));
+    send_all(fd, &gid, sizeof(gid));
+    send_all(fd, &asec, sizeof(asec));
+    send_all(fd, &ansec, sizeof(ansec));
+    send_all(fd, &msec, sizeof(msec));
+    send_all(fd, &mnsec, sizeof(mnsec));
+
+    // Only user.* attributes: the others need privileges or describe the local system
+    ssize_t len = 0;
+    uint32_t nx = 0;
+    if (sync_xattrs && full_path(m->entry, xfer_path, sizeof(xfer_path)) == 0 &&
+        (len = llistxattr(xfer_path, xattr_list, sizeof(xattr_list))) < 0)
+        len = 0;
+    for (ssize_t i = 0; i < len; i += strlen(xattr_list + i) + 1)
+        if (strncmp(xattr_list + i, "user.", 5) == 0) nx++;
+    uint32_t be = htonl(nx);
+    send_all(fd, &be, sizeof(be));
+    for (ssize_t i = 0; i < len && nx; i += strlen(xattr_list + i) + 1) {
+        const char *xn = xattr_list + i;
+        if (strncmp(xn, "user.", 5) != 0) continue;
+        ssize_t vl = lgetxattr(xfer_path, xn, xattr_value, sizeof(xattr_value));
+        if (vl < 0) vl = 0; // removed since the listing; an empty value keeps the count right
+        uint32_t xl = htonl(strlen(xn)), bv = htonl(vl);
+        send_all(fd, &xl, sizeof(xl));
+        send_all(fd, xn, strlen(xn));
+        send_all(fd, &bv, sizeof(bv));
+        send_all(fd, xattr_value, vl);
+        nx--;
+    }
+    remember_meta(m->entry, st);
+    remember_sent(m->entry, st->st_mtime, st->st_size);
+}
+
+// Sends queued attribute changes as one MSG_TYPE_META message per directory.
+void flush_meta(int fd) {
+    int n = 0;
+    for (int i = 0; i < meta_count; i++) {
+        MetaUpdate m = meta_pending[i];
+        m.entry->meta_queued = 0;
+        // Skip files that were written or removed since they were queued
+        if (m.entry->queued || full_path(m.entry, xfer_path, sizeof(xfer_path)) < 0 ||
+            lstat(xfer_path, &m.st) < 0 || m.st.st_size != m.entry->last_sent_size)
+            continue;
+        meta_pending[n++] = m;
+    }
+    meta_count = 0;
+    qsort(meta_pending, n, sizeof(MetaUpdate), meta_order);
+    for (int i = 0; i < n;) {
+        const char *rel = meta_pending[i].entry->rel, *slash = strrchr(rel, '/');
+        size_t dl = slash ? (size_t)(slash - rel) : 0;
+        int j = i + 1;
+        while (j < n) {
+            const char *r = meta_pending[j].entry->rel, *sl = strrchr(r, '/');
+            if ((sl ? (size_t)(sl - r) : 0) != dl || strncmp(r, rel, dl) != 0) break;
+            j++;
+        }
+        uint8_t msg_type = MSG_TYPE_META;
+        uint32_t nl = htonl(dl), count = htonl(j - i);
+        send_all(fd, &msg_type, 1);
+        send_all(fd, &nl, sizeof(nl));
+        send_all(fd, rel, dl);
+        send_all(fd, &count, sizeof(count));
+        for (int k = i; k < j; k++) send_meta_entry(fd, &meta_pending[k], dl ? dl + 1 : 0);
+        snprintf(xfer_path, sizeof(xfer_path), "%.*s", dl ? (int)dl : 1, dl ? rel : ".");
+        log_event("CLIENT->SERVER", "Metadata", xfer_path, NULL);
+        printf("? Metadata sent: %s (%d files)\n", xfer_path, j - i);
+        i = j;
+    }
+}
+
+// A rescan sees no event mask, so it applies enqueue_change()'s attribute rule to the
+// stat instead: same size and inode as last sent, not written since, attributes differ.
+void enqueue_scanned(const char *path) {
+    PathEntry *e = path_entry(rel_of(path), 0);
+    struct stat st;
+    if (e && !e->modified && e->last_sent_mtime && e->last_ctim.tv_sec && meta_count < MAX_PENDING &&
+        lstat(path, &st) == 0 && st.st_size == e->last_sent_size &&
+        (!e->last_sent_ino || e->last_sent_ino == st.st_ino) && !meta_synced(e, &st))
+        enqueue_meta(e, path);
+    else
+        enqueue_transfer(path);
+}
+
+// Walk the directory in scan_path[0..len) with raw getdents64, extending scan_path in
+// place for each entry, so a rescan neither allocates nor copies paths per level.
+void poll_dir(size_t len) {
+    int dfd = open(scan_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) return;
+    char dents[4096];
+    ssize_t n;
+    while ((n = getdents64(dfd, dents, sizeof(dents))) > 0) {
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64 *e = (struct dirent64 *)(dents + off);
+            off += e->d_reclen;
+            if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+            size_t nl = strlen(e->d_name);
+            if (len + 1 + nl >= sizeof(scan_path)) {
+                fprintf(stderr, "Warning: path too long and truncated: %s/%s\n", scan_path, e->d_name);
+                continue;
+            }
+            scan_path[len] = '/';
+            memcpy(scan_path + len + 1, e->d_name, nl + 1);
+            const char *rel = scan_path + strlen(WATCH_DIR) + 1;
+            if (e->d_type == DT_DIR && !rule_excluded(rel, 1)) poll_dir(len + 1 + nl);
+            else if (e->d_type == DT_REG && !rule_excluded(rel, 0)) enqueue_scanned(scan_path);
+            scan_path[len] = 0;
+        }
+    }
+    close(dfd);
+}
+
+// Reads STATE_FILE, or picks a new node id when there is none.
+void load_state(void) {
+    FILE *f = fopen(WATCH_DIR "/" STATE_FILE, "rb");
+    char magic[8], rel[MAX_PATH];
+    uint32_t nodes = 0, len;
+    size_t loaded = 0;
+    if (f && fread(magic, 1, 8, f) == 8 && memcmp(magic, STATE_MAGIC, 8) == 0 && fread(&nodes, sizeof(nodes), 1, f) == 1 &&
+        nodes >= 1 && nodes <= VV_NODES && fread(vv_nodes, sizeof(uint64_t), nodes, f) == nodes &&
+        fread(&state_peer, sizeof(state_peer), 1, f) == 1) {
+        vv_node_count = nodes;
+        while (fread(&len, sizeof(len), 1, f) == 1 && len < sizeof(rel) && fread(rel, 1, len, f) == len) {
+            int64_t mtime, size, nsec;
+            uint64_t ino;
+            VersionVector vv, peer_vv;
+            rel[len] = 0;
+            if (fread(&mtime, sizeof(mtime), 1, f) != 1 || fread(&size, sizeof(size), 1, f) != 1 ||
+                fread(&nsec, sizeof(nsec), 1, f) != 1 || fread(&ino, sizeof(ino), 1, f) != 1 ||
+                fread(&vv, sizeof(vv), 1, f) != 1 || fread(&peer_vv, sizeof(peer_vv), 1, f) != 1)
+                break;
+            PathEntry *e = path_entry(rel, 1);
+            if (!e) break;
+            e->vv = vv;
+            e->peer_vv = peer_vv;
+            e->last_sent_mtime = mtime;
+            e->last_sent_size = size;
+            e->last_sent_nsec = nsec;
+            e->last_sent_ino = ino;
+            loaded++;
+        }
+        printf("? Loaded versions of %zu files, node %016llx\n", loaded, (unsigned long long)vv_nodes[0]);
+    } else {
+        uint64_t id = 0;
+        if (getrandom(&id, sizeof(id), 0) != sizeof(id) || !id) id = (uint64_t)time(NULL) << 32 ^ getpid();
+        vv_nodes[0] = id;
+        vv_node_count = 1;
+        state_dirty = 1;
+    }
+    if (f) fclose(f);
+}
+
+// save_state() output, staged in chunk_buf (free on the main thread between transfers) so
+// saving allocates nothing.
+int state_fd = -1, state_bad = 0; size_t state_len = 0;
+
+void state_flush(void) {
+    for (size_t done = 0; done < state_len && !state_bad;) {
+        ssize_t n = write(state_fd, chunk_buf + done, state_len - done);
+        if (n <= 0) state_bad = 1;
+        else done += n;
+    }
+    state_len = 0;
+}
+
+void state_put(const void *p, size_t n) {
+    if (state_len + n > CHUNK_SIZE) state_flush();
+    memcpy(chunk_buf + state_len, p, n);
+    state_len += n;
+}
+
+// Rewrites STATE_FILE through a temp file, so a crash leaves the previous one.
+void save_state(void) {
+    char temp[MAX_PATH];
+    if (temp_path(WATCH_DIR "/" STATE_FILE, temp, sizeof(temp)) < 0) return;
+    state_fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (state_fd < 0) {
+        fprintf(stderr, "Warning: cannot write %s: %s\n", temp, strerror(errno));
+        return;
+    }
+    state_bad = 0;
+    state_len = 0;
+    uint32_t nodes = vv_node_count;
+    state_put(STATE_MAGIC, 8);
+    state_put(&nodes, sizeof(nodes));
+    state_put(vv_nodes, nodes * sizeof(uint64_t));
+    state_put(&state_peer, sizeof(state_peer));
+    static const VersionVector none;
+    for (size_t i = 0; i < path_table_cap; i++) {
+        const PathEntry *e = path_table[i];
+        if (!e || memcmp(&e->vv, &none, sizeof(none)) == 0) continue;
+        uint32_t len = strlen(e->rel);
+        int64_t mtime = e->last_sent_mtime, size = e->last_sent_size, nsec = e->last_sent_nsec;
+        uint64_t ino = e->last_sent_ino;
+        state_put(&len, sizeof(len));
+        state_put(e->rel, len);
+        state_put(&mtime, sizeof(mtime));
+        state_put(&size, sizeof(size));
+        state_put(&nsec, sizeof(nsec));
+        state_put(&ino, sizeof(ino));
+        state_put(&e->vv, sizeof(e->vv));
+        state_put(&e->peer_vv, sizeof(e->peer_vv));
+    }
+    state_flush();
+    if (close(state_fd) != 0 || state_bad || rename(temp, WATCH_DIR "/" STATE_FILE) < 0) {
+        fprintf(stderr, "Warning: cannot save %s\n", STATE_FILE);
+        unlink(temp);
+        return;
+    }
+    state_dirty = 0;
+}
+
+void poll_files(void) {
+    snprintf(scan_path, sizeof(scan_path), "%s", WATCH_DIR);
+    poll_dir(strlen(scan_path));
+    if (state_dirty) save_state();
+    usleep(500000);
+}
+
+// One change to rel (relative to WATCH_DIR), in inotify terms whichever backend saw it.
+void handle_event(const char *rel, uint32_t mask, uint32_t cookie, int fd) {
+    if (strcmp(rel, IGNORE_FILE) == 0 && strcmp(ignore_file, WATCH_DIR "/" IGNORE_FILE) == 0 &&
+        (mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)))
+        load_rules();
+    if (!*rel || (mask & IN_ISDIR) || rule_excluded(rel, 0)) return;
+    char fp[MAX_PATH];
+    int ret = snprintf(fp, sizeof(fp), "%s/%s", WATCH_DIR, rel);
+    if (ret < 0 || ret >= (int)sizeof(fp)) {
+        fprintf(stderr, "Warning: path too long in watch event, skipping\n");
+        return;
+    }
+    if ((mask & IN_MOVED_FROM) && cookie) {
+        strncpy(moved_from, fp, sizeof(moved_from));
+        moved_cookie = cookie;
+    } else if ((mask & IN_MOVED_TO) && (cookie && moved_cookie && cookie == moved_cookie)) {
+        flush_transfers(moved_from, fd);
+        send_rename(moved_from, fp, fd);
+        moved_from[0] = 0;
+        moved_cookie = 0;
+    } else if (mask & IN_DELETE) {
+        flush_transfers(fp, fd);
+        send_delete(fp, fd);
+    } else {
+        if (meta_count == MAX_PENDING) flush_meta(fd);
+        enqueue_change(fp, mask);
+    }
+}
+
+void read_inotify(int ifd, int fd) {
+    char buf[4096];
+    int len = read(ifd, buf, sizeof(buf)), i = 0;
+    while (i < len) {
+        struct inotify_event *e = (struct inotify_event *)(buf + i);
+        if (e->len) handle_event(e->name, e->mask, e->cookie, fd);
+        i += sizeof(*e) + e->len;
+    }
+}
+
+int fanotify_open(void) {
+    if (!realpath(WATCH_DIR, watch_root)) return -1;
+    watch_root_len = strlen(watch_root);
+    int ffd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY);
+    if (ffd < 0) return -1;
+    if (fanotify_mark(ffd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FAN_EVENTS | FAN_ONDIR, AT_FDCWD, WATCH_DIR) < 0 ||
+        (fan_mount_fd = open(WATCH_DIR, O_RDONLY | O_DIRECTORY)) < 0 ||
+        !(dir_cache = counted_realloc(NULL, DIR_CACHE_SLOTS * sizeof(DirHandle)))) {
+        close(ffd);
+        return -1;
+    }
+    memset(dir_cache, 0, DIR_CACHE_SLOTS * sizeof(DirHandle));
+    return ffd;
+}
+
+// Directory of a fanotify name record, relative to WATCH_DIR ("" for the root itself), or
+// NULL if it is outside WATCH_DIR or already gone. Handles are resolved once and cached, so
+// an event costs a hash probe no matter how many directories the filesystem has.
+const char *fan_dir(struct fanotify_event_info_fid *fid) {
+    struct file_handle *fh = (struct file_handle *)fid->handle;
+    const unsigned char *key = (const unsigned char *)&fid->fsid;
+    size_t len = sizeof(fid->fsid) + sizeof(*fh) + fh->handle_bytes;
+    if (len > sizeof(dir_cache[0].key)) return NULL;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ key[i]) * 16777619u;
+    DirHandle *d = &dir_cache[h % DIR_CACHE_SLOTS];
+    if (d->used && d->hash == h && d->len == len && memcmp(d->key, key, len) == 0)
+        return d->dir ? d->dir->rel : NULL;
+
+    int dfd = open_by_handle_at(fan_mount_fd, fh, O_PATH | O_DIRECTORY);
+    if (dfd < 0) return NULL;
+    char link[32], path[MAX_PATH];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", dfd);
+    ssize_t n = readlink(link, path, sizeof(path) - 1);
+    close(dfd);
+    if (n < 0) return NULL;
+    path[n] = 0;
+    d->dir = NULL;
+    if (strncmp(path, watch_root, watch_root_len) == 0 && (path[watch_root_len] == '/' || !path[watch_root_len]))
+        d->dir = path_entry(path + watch_root_len + (path[watch_root_len] == '/'), 1);
+    d->used = 1;
+    d->hash = h;
+    d->len = len;
+    memcpy(d->key, key, len);
+    return d->dir ? d->dir->rel : NULL;
+}
+
+// Path of a name record relative to WATCH_DIR, or 0 when it is outside.
+int fan_path(struct fanotify_event_info_fid *fid, char *out, size_t len) {
+    const char *dir = fan_dir(fid);
+    if (!dir) return 0;
+    struct file_handle *fh = (struct file_handle *)fid->handle;
+    const char *name = (const char *)fh->f_handle + fh->handle_bytes;
+    int ret = snprintf(out, len, "%s%s%s", dir, *dir ? "/" : "", name);
+    return ret > 0 && ret < (int)len;
+}
+
+void read_fanotify(int ffd, int fd) {
+    static const struct { uint64_t fan; uint32_t in; } masks[] = {
+        { FAN_CREATE, IN_CREATE }, { FAN_MODIFY, IN_MODIFY }, { FAN_CLOSE_WRITE, IN_CLOSE_WRITE },
+        { FAN_ATTRIB, IN_ATTRIB }, { FAN_DELETE, IN_DELETE }, { FAN_ONDIR, IN_ISDIR },
+    };
+    char buf[8192] __attribute__((aligned(8)));
+    ssize_t len = read(ffd, buf, sizeof(buf));
+    for (struct fanotify_event_metadata *m = (void *)buf; FAN_EVENT_OK(m, len); m = FAN_EVENT_NEXT(m, len)) {
+        if (m->vers != FANOTIFY_METADATA_VERSION) break;
+        if (m->mask & FAN_Q_OVERFLOW) {
+            fprintf(stderr, "Warning: fanotify queue overflowed, rescanning\n");
+            poll_files();
+            continue;
+        }
+        // A directory moved or went away: every cached path below it may be stale.
+        if ((m->mask & FAN_ONDIR) && (m->mask & (FAN_RENAME | FAN_DELETE)))
+            memset(dir_cache, 0, DIR_CACHE_SLOTS * sizeof(DirHandle));
+        uint32_t mask = 0;
+        for (size_t i = 0; i < sizeof(masks) / sizeof(masks[0]); i++)
+            if (m->mask & masks[i].fan) mask |= masks[i].in;
+
+        char rel[MAX_PATH], old_rel[MAX_PATH], new_rel[MAX_PATH];
+        int have = 0, have_old = 0, have_new = 0;
+        for (char *p = (char *)(m + 1); p + sizeof(struct fanotify_event_info_header) <= (char *)m + m->event_len;) {
+            struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *)p;
+            if (fid->hdr.len == 0) break;
+            if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) have = fan_path(fid, rel, sizeof(rel));
+            else if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME) have_old = fan_path(fid, old_rel, sizeof(old_rel));
+            else if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME) have_new = fan_path(fid, new_rel, sizeof(new_rel));
+            p += fid->hdr.len;
+        }
+        if (m->mask & FAN_RENAME) {
+            // Both ends come in one event; moves across the WATCH_DIR boundary become a delete or a create.
+            uint32_t dir = mask & IN_ISDIR;
+            if (have_old && have_new) {
+                handle_event(old_rel, IN_MOVED_FROM | dir, ++fan_cookie, fd);
+                handle_event(new_rel, IN_MOVED_TO | dir, fan_cookie, fd);
+            } else if (have_old) handle_event(old_rel, IN_DELETE | dir, 0, fd);
+            else if (have_new) handle_event(new_rel, IN_MOVED_TO | dir, 0, fd);
+            mask &= ~(IN_DELETE | IN_CREATE);
+            if (!have_new || !(mask & ~IN_ISDIR)) continue;
+            memcpy(rel, new_rel, sizeof(rel));
+            have = 1;
+        }
+        if (!have || !(mask & ~IN_ISDIR)) continue;
+        // Merged events can report a delete for a name that has since been created again.
+        if (mask & IN_DELETE) {
+            char fp[MAX_PATH];
+            struct stat st;
+            if (snprintf(fp, sizeof(fp), "%s/%s", WATCH_DIR, rel) < (int)sizeof(fp) && lstat(fp, &st) == 0)
+                mask = (mask & ~IN_DELETE) | IN_CREATE;
+        }
+        handle_event(rel, mask, 0, fd);
+    }
+}
+
+// The --watcher backend, falling back to inotify if fanotify is unavailable (it needs CAP_SYS_ADMIN).
+int watch_open(void) {
+    if (watcher == WATCH_FANOTIFY) {
+        int ffd = fanotify_open();
+        if (ffd >= 0) {
+            printf("?? Watching the filesystem of %s with fanotify\n", WATCH_DIR);
+            return ffd;
+        }
+        fprintf(stderr, "Warning: fanotify unavailable (%s), using inotify\n", strerror(errno));
+        watcher = WATCH_INOTIFY;
+    }
+    int ifd = inotify_init1(IN_NONBLOCK);
+    inotify_add_watch(ifd, WATCH_DIR, EVENT_MASK);
+    return ifd;
+}
+
+void watch_read(int wfd, int fd) {
+    if (watcher == WATCH_FANOTIFY) read_fanotify(wfd, fd);
+    else read_inotify(wfd, fd);
+}
+
+int recv_name(int fd, char *fn, size_t maxlen) {
+    uint32_t nl;
+    if (recv_all(fd, &nl, sizeof(nl)) <= 0) return -1;
+    nl = ntohl(nl);
+    if (nl >= maxlen) {
+        fprintf(stderr, "Warning: received name too long (%u bytes)\n", nl);
+        return -1;
+    }
+    if (nl && recv_all(fd, fn, nl) <= 0) return -1;
+    fn[nl] = 0;
+    return 0;
+}
+
+// Receives a relative name into msg_name (or msg_name2) and builds its WATCH_DIR path next to it.
+int recv_path(int fd, char *name, char *full) {
+    if (recv_name(fd, name, MAX_PATH) < 0) return -1;
+    int ret = snprintf(full, MAX_PATH, "%s/%s", WATCH_DIR, name);
+    if (ret < 0 || ret >= MAX_PATH) {
+        fprintf(stderr, "Warning: full path truncation on receive\n");
+        return -1;
+    }
+    return 0;
+}
+
+void ensure_parent(char *full) {
+    char *slash = strrchr(full, '/');
+    if (!slash) return;
+    *slash = 0;
+    ensure_dir(full);
+    *slash = '/';
+}
+
+void receive_delete(int fd) {
+    if (recv_path(fd, msg_name, msg_full) < 0) return;
+    if (unlink(msg_full) == 0) {
+        log_event("SERVER->CLIENT", "Deleted", msg_name, NULL);
+        printf("? Deleted received: %s\n", msg_name);
+    }
+    sleep(1);
+}
+
+void receive_rename(int fd) {
+    if (recv_path(fd, msg_name, msg_full) < 0) return;
+    if (recv_path(fd, msg_name2, msg_full2) < 0) return;
+    ensure_parent(msg_full2);
+
+    if (rename(msg_full, msg_full2) == 0) {
+        vv_rename(msg_name, msg_name2);
+        log_event("SERVER->CLIENT", "Renamed", msg_name, msg_name2);
+        printf("? Rename received: %s -> %s\n", msg_name, msg_name2);
+    }
+}
+
+// Compares an incoming version of e with ours, counting a local edit not yet seen first.
+// Concurrent edits are settled the same way on both peers: the later mtime wins, then the
+// higher node id. *settled is set when the peer already holds our version and so reaches
+// the same result on its own.
+int vv_decide(PathEntry *e, const char *full, const VersionVector *remote, time_t remote_mtime, int *settled) {
+    struct stat st;
+    *settled = 0;
+    if (lstat(full, &st) < 0 || !S_ISREG(st.st_mode)) return VV_TAKE;
+    vv_note_local(e, &st);
+    if (!vv_newer(&e->vv, remote)) return vv_newer(remote, &e->vv) ? VV_TAKE : VV_DROP;
+    if (!vv_newer(remote, &e->vv)) return VV_DROP;
+    *settled = !vv_newer(&e->vv, &e->peer_vv);
+    if (st.st_mtime != remote_mtime) return st.st_mtime > remote_mtime ? VV_KEEP_LOCAL : VV_KEEP_REMOTE;
+    return vv_nodes[0] > peer_node ? VV_KEEP_LOCAL : VV_KEEP_REMOTE;
+}
+
+// "dir/name.conflict-<node>.ext" for the losing side of a conflict on full.
+int conflict_path(const char *full, uint64_t node, char *out, size_t len) {
+    const char *base = strrchr(full, '/');
+    const char *dot = strrchr(base ? base : full, '.');
+    if (!dot || dot == base + 1) dot = full + strlen(full);
+    int ret = snprintf(out, len, "%.*s.conflict-%08x%s", (int)(dot - full), full, (uint32_t)node, dot);
+    return ret < 0 || ret >= (int)len ? -1 : 0;
+}
+
+int same_contents(const char *a, const char *b) {
+    struct stat sa, sb;
+    if (stat(a, &sa) < 0 || stat(b, &sb) < 0 || sa.st_size != sb.st_size) return 0;
+    int fa = open(a, O_RDONLY), fb = open(b, O_RDONLY);
+    char *other = buffer_get();
+    int same = fa >= 0 && fb >= 0 && other;
+    for (off_t off = 0; same && off < sa.st_size; off += CHUNK_SIZE) {
+        size_t want = sa.st_size - off < CHUNK_SIZE ? sa.st_size - off : CHUNK_SIZE;
+        same = pread(fa, chunk_buf, want, off) == (ssize_t)want && pread(fb, other, want, off) == (ssize_t)want &&
+               memcmp(chunk_buf, other, want) == 0;
+    }
+    buffer_put(other);
+    if (fa >= 0) close(fa);
+    if (fb >= 0) close(fb);
+    return same;
+}
+
+// Reads the header written by send_file_header() into msg_name/msg_full and prepares the
+// destination directory. Returns the interned entry for the file.
+PathEntry *recv_file_header(int fd, uint64_t *fs, mode_t *pm, struct utimbuf *ut, VersionVector *vv) {
+    if (recv_path(fd, msg_name, msg_full) < 0) return NULL;
+    if (recv_all(fd, fs, sizeof(*fs)) <= 0) return NULL;
+    *fs = be64toh(*fs);
+    if (recv_all(fd, pm, sizeof(*pm)) <= 0) return NULL;
+    if (recv_all(fd, ut, sizeof(*ut)) <= 0) return NULL;
+    if (recv_vv(fd, vv) < 0) return NULL;
+    ensure_parent(msg_full);
+    return path_entry(msg_name, 1);
+}
+
+IncomingStream *find_incoming(const PathEntry *e) {
+    for (int i = 0; i < incoming_count; i++)
+        if (e && incoming[i].entry == e) return &incoming[i];
+    return NULL;
+}
+
+// Swaps the last stream into s; the chunk lists stay with their slots for reuse.
+void release_incoming(IncomingStream *s, int discard) {
+    if (s->fd >= 0) close(s->fd);
+    if (discard) unlink(s->temp);
+    IncomingStream done = *s;
+    *s = incoming[--incoming_count];
+    incoming[incoming_count].sums = done.sums;
+    incoming[incoming_count].actual = done.actual;
+    incoming[incoming_count].cap = done.cap;
+}
+
+int add_chunk_sum(IncomingStream *s, uint64_t offset, uint32_t len, uint32_t crc) {
+    if (s->nsums == s->cap) {
+        uint32_t cap = s->cap ? s->cap * 2 : 16;
+        ChunkSum *n = counted_realloc(s->sums, cap * sizeof(ChunkSum));
+        if (!n) return -1;
+        s->sums = n;
+        uint32_t *a = counted_realloc(s->actual, cap * sizeof(uint32_t));
+        if (!a) return -1;
+        s->actual = a;
+        s->cap = cap;
+    }
+    s->sums[s->nsums++] = (ChunkSum){ offset, len, crc };
+    return 0;
+}
+
+// Ask the peer for a byte range of rel again. A zero length asks for the whole file.
+void send_chunk_request(int fd, const char *rel, uint64_t offset, uint32_t len) {
+    uint8_t msg_type = MSG_TYPE_CHUNK_REQ;
+    uint32_t nl = htonl(strlen(rel));
+    uint64_t off = htobe64(offset);
+    uint32_t cl = htonl(len);
+    send_all(fd, &msg_type, 1);
+    send_all(fd, &nl, sizeof(nl));
+    send_all(fd, rel, strlen(rel));
+    send_all(fd, &off, sizeof(off));
+    send_all(fd, &cl, sizeof(cl));
+}
+
+// Puts a received copy of e, already written to temp, in place by its version vector: over
+// full, beside it as a conflict copy, or nowhere when ours already includes it. Returns the
+// VV_* outcome, or -1 if temp could not be used. temp is left behind for VV_DROP and -1.
+int place_received(PathEntry *e, const char *temp, const char *full, const VersionVector *vv, time_t mtime, off_t size) {
+    int settled;
+    int how = vv_decide(e, full, vv, mtime, &settled);
+    if (how == VV_DROP) {
+        vv_sent(e, vv);
+        return VV_DROP;
+    }
+    int concurrent = how != VV_TAKE;
+    if (concurrent && same_contents(temp, full)) how = VV_TAKE;
+    char copy[MAX_PATH];
+    VersionVector loser = how == VV_KEEP_LOCAL ? *vv : e->vv;
+    // Our version is linked aside rather than renamed, which the watcher would pass on as a rename.
+    // An older conflict copy from the same node is replaced.
+    if (how != VV_TAKE &&
+        (conflict_path(full, how == VV_KEEP_LOCAL ? peer_node : vv_nodes[0], copy, sizeof(copy)) < 0 ||
+         (how == VV_KEEP_REMOTE && (unlink(copy), link(full, copy) < 0)))) {
+        fprintf(stderr, "Warning: cannot keep both versions of %s, dropping the peer's\n", e->rel);
+        return -1;
+    }
+    if (rename(temp, how == VV_KEEP_LOCAL ? copy : full) < 0) return -1;
+
+    vv_merge(&e->vv, vv);
+    vv_sent(e, vv);
+    if (concurrent && settled) e->peer_vv = e->vv;
+    struct stat st;
+    if (how != VV_KEEP_LOCAL) {
+        remember_sent(e, mtime, size);
+        if (lstat(full, &st) == 0) {
+            vv_settle(e, &st);
+            remember_meta(e, &st);
+        }
+    }
+    if (how != VV_TAKE) {
+        // When settled the peer makes the same copy, so both sides record it as already in sync.
+        PathEntry *c = path_entry(rel_of(copy), 1);
+        if (c && settled && lstat(copy, &st) == 0) {
+            c->vv = c->peer_vv = loser;
+            remember_sent(c, st.st_mtime, st.st_size);
+            vv_settle(c, &st);
+        }
+        log_event("CLIENT->SERVER", "Conflict", e->rel, rel_of(copy));
+        printf("? Conflict: %s changed on both sides, kept the %s version, other saved as %s\n", e->rel,
+               how == VV_KEEP_LOCAL ? "local" : "peer's", rel_of(copy));
+    }
+    return how;
+}
+
+// Moves a complete temp file into place with the sender's mode and times.
+void commit_incoming(IncomingStream *s) {
+    fchmod(s->fd, s->mode);
+    close(s->fd);
+    s->fd = -1;
+    utime(s->temp, &s->ut);
+    PathEntry *e = s->entry;
+    char full[MAX_PATH];
+    snprintf(full, sizeof(full), "%s", s->full);
+    // Decided here, not when the header came: the file may have been edited, or ours sent, meanwhile.
+    int how = place_received(e, s->temp, full, &s->vv, s->ut.modtime, s->size);
+    if (how == VV_TAKE) {
+        log_event("CLIENT->SERVER", "Received", e->rel, NULL);
+        printf("? Received: %s\n", e->rel);
+    }
+    int behind = how >= 0 && vv_newer(&e->vv, &e->peer_vv);
+    release_incoming(s, how < 0 || how == VV_DROP);
+    if (behind) enqueue_transfer(full);
+}
+
+// Index in s->sums of the chunk at offset, or -1 if it has not arrived. First arrivals come
+// in offset order, so the list stays sorted.
+long find_chunk_sum(const IncomingStream *s, uint64_t offset) {
+    long lo = 0, hi = (long)s->nsums - 1;
+    while (lo <= hi) {
+        long mid = (lo + hi) / 2;
+        if (s->sums[mid].offset == offset) return mid;
+        if (s->sums[mid].offset < offset) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -1;
+}
+
+// Asks again for chunk i of s, whose data did not match its CRC. Returns -1, with s
+// released, once the file is given up on and requested whole.
+int request_repair(IncomingStream *s, uint32_t i, int fd) {
+    const char *rel = s->entry->rel;
+    if (s->rounds > MAX_REPAIR_ROUNDS) {
+        fprintf(stderr, "Warning: %s still corrupt after %d repair rounds, requesting full resend\n",
+                rel, MAX_REPAIR_ROUNDS);
+        send_chunk_request(fd, rel, 0, 0);
+        release_incoming(s, 1);
+        return -1;
+    }
+    send_chunk_request(fd, rel, s->sums[i].offset, s->sums[i].len);
+    s->repairs_outstanding++;
+    printf("? Checksum mismatch: %s @%llu, re-requested\n", rel, (unsigned long long)s->sums[i].offset);
+    return 0;
+}
+
+// Checks the sender's chunk list against the CRCs taken as the chunks arrived, re-requests
+// any that failed and were not asked for yet, and commits the file once all match.
+// Returns 1 once the stream is finished with.
+int verify_incoming(IncomingStream *s, uint32_t file_crc, int fd) {
+    const char *rel = s->entry->rel;
+    uint32_t expect = 0;
+    for (uint32_t i = 0; i < s->nsums; i++) expect = crc32c_chain(expect, s->sums[i].crc);
+    if (expect != file_crc) {
+        fprintf(stderr, "Warning: chunk list for %s does not match, requesting full resend\n", rel);
+        send_chunk_request(fd, rel, 0, 0);
+        release_incoming(s, 1);
+        return 1;
+    }
+    // Streamed chunks that failed are asked for on arrival, so with repairs pending there is nothing new.
+    int fresh = !s->repairs_outstanding;
+    for (uint32_t i = 0; fresh && i < s->nsums; i++)
+        if (s->actual[i] != s->sums[i].crc && request_repair(s, i, fd) < 0) return 1;
+    s->ended = 1;
+    if (s->repairs_outstanding) return 0;
+    commit_incoming(s);
+    return 1;
+}
+
+// Tells the peer we already hold vv of rel, so it can stop streaming its copy.
+void send_have(int fd, const char *rel, const VersionVector *vv) {
+    uint8_t msg_type = MSG_TYPE_FILE_HAVE;
+    uint32_t nl = htonl(strlen(rel));
+    send_all(fd, &msg_type, 1);
+    send_all(fd, &nl, sizeof(nl));
+    send_all(fd, rel, strlen(rel));
+    send_vv(fd, vv);
+}
+
+// Writes land in a dot-prefixed temp file next to the target until verify_incoming() commits them.
+// Returns NULL when the payload is to be drained and dropped, including when we already hold
+// a version that includes vv.
+IncomingStream *open_incoming(PathEntry *e, const char *full, uint64_t fs, mode_t pm, const struct utimbuf *ut,
+                              const VersionVector *vv, int fd) {
+    IncomingStream *s = find_incoming(e);
+    if (s) release_incoming(s, 1);
+    int settled;
+    if (e && vv_decide(e, full, vv, ut->modtime, &settled) == VV_DROP) {
+        vv_sent(e, vv);
+        send_have(fd, e->rel, &e->vv);
+        printf("? Already have: %s\n", e->rel);
+        if (vv_newer(&e->vv, &e->peer_vv)) enqueue_transfer(full);
+        return NULL;
+    }
+    if (!e || incoming_count >= MAX_STREAMS) {
+        fprintf(stderr, "Warning: too many incoming streams, dropping %s\n", full);
+        return NULL;
+    }
+    s = &incoming[incoming_count];
+    ChunkSum *sums = s->sums;
+    uint32_t *actual = s->actual, cap = s->cap;
+    memset(s, 0, sizeof(*s));
+    s->sums = sums;
+    s->actual = actual;
+    s->cap = cap;
+    if (temp_path(full, s->temp, sizeof(s->temp)) < 0) {
+        fprintf(stderr, "Warning: temp path truncation on receive\n");
+        return NULL;
+    }
+    s->fd = open(s->temp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (s->fd < 0) return NULL;
+    incoming_count++;
+    s->entry = e;
+    snprintf(s->full, sizeof(s->full), "%s", full);
+    s->size = fs;
+    s->mode = pm;
+    s->ut = *ut;
+    s->vv = *vv;
+    return s;
+}
+
+void receive_stream_begin(int fd) {
+    uint64_t fs;
+    mode_t pm;
+    struct utimbuf ut;
+    VersionVector vv;
+    uint32_t ne;
+    PathEntry *e = recv_file_header(fd, &fs, &pm, &ut, &vv);
+    if (!e) return;
+    if (recv_all(fd, &ne, sizeof(ne)) <= 0) return;
+    ne = ntohl(ne);
+    uint64_t data = 0, end = 0;
+    int ok = 1;
+    for (uint32_t i = 0; i < ne; i++) {
+        uint64_t eo, el;
+        if (recv_all(fd, &eo, sizeof(eo)) <= 0) return;
+        if (recv_all(fd, &el, sizeof(el)) <= 0) return;
+        eo = be64toh(eo);
+        el = be64toh(el);
+        if (eo < end || eo + el > fs) ok = 0;
+        end = eo + el;
+        data += el;
+    }
+
+    IncomingStream *s = open_incoming(e, msg_full, fs, pm, &ut, &vv, fd);
+    if (!s) return;
+    if (!ok) {
+        fprintf(stderr, "Warning: bad extent map for %s, requesting full resend\n", e->rel);
+        send_chunk_request(fd, e->rel, 0, 0);
+        release_incoming(s, 1);
+        return;
+    }
+    // Size the temp file up front; ranges no chunk writes to stay holes.
+    ftruncate(s->fd, fs);
+    s->expected_bytes = data;
+    printf("? Receiving stream: %s (%llu bytes, %llu in %u extents)\n", e->rel, (unsigned long long)fs,
+           (unsigned long long)data, ne);
+}
+
+void receive_stream_chunk(int fd) {
+    uint64_t off;
+    uint32_t cl, crc;
+    if (recv_name(fd, msg_name, sizeof(msg_name)) < 0) return;
+    if (recv_all(fd, &off, sizeof(off)) <= 0) return;
+    if (recv_all(fd, &cl, sizeof(cl)) <= 0) return;
+    if (recv_all(fd, &crc, sizeof(crc)) <= 0) return;
+    off = be64toh(off);
+    cl = ntohl(cl);
+    crc = ntohl(crc);
+
+    IncomingStream *s = find_incoming(path_entry(msg_name, 0));
+    uint64_t start = off;
+    uint32_t len = cl, got = 0;
+    int failed = 0;
+    while (cl > 0) {
+        size_t n = cl < CHUNK_SIZE ? cl : CHUNK_SIZE;
+        if (recv_all(fd, chunk_buf, n) <= 0) return;
+        if (s) {
+            got = crc32c(got, chunk_buf, n);
+            failed |= pwrite(s->fd, chunk_buf, n, off) != (ssize_t)n;
+        }
+        off += n;
+        cl -= n;
+    }
+    if (!s) return;
+    // Checked here while the data is in chunk_buf; a bad chunk is asked for again at once.
+    long i = find_chunk_sum(s, start);
+    if (i < 0) {
+        if (add_chunk_sum(s, start, len, crc) < 0) return;
+        i = s->nsums - 1;
+        s->received_bytes += len;
+    } else {
+        // A repair: the CRC to meet is still the one the chunk first came with.
+        s->repairs_outstanding--;
+        if (failed || got != s->sums[i].crc) s->rounds++;
+    }
+    s->actual[i] = failed ? ~s->sums[i].crc : got;
+    if (s->actual[i] != s->sums[i].crc && request_repair(s, i, fd) < 0) return;
+    if (s->ended && !s->repairs_outstanding) {
+        uint32_t file_crc = 0;
+        for (uint32_t j = 0; j < s->nsums; j++) file_crc = crc32c_chain(file_crc, s->sums[j].crc);
+        verify_incoming(s, file_crc, fd);
+    }
+}
+
+void receive_stream_end(int fd) {
+    uint32_t nc, file_crc;
+    if (recv_name(fd, msg_name, sizeof(msg_name)) < 0) return;
+    if (recv_all(fd, &nc, sizeof(nc)) <= 0) return;
+    if (recv_all(fd, &file_crc, sizeof(file_crc)) <= 0) return;
+    IncomingStream *s = find_incoming(path_entry(msg_name, 0));
+    if (!s) return;
+    if (ntohl(nc) != s->nsums || s->received_bytes != s->expected_bytes) {
+        fprintf(stderr, "Warning: %s ended after %u of %u chunks, requesting full resend\n", msg_name, s->nsums, ntohl(nc));
+        send_chunk_request(fd, msg_name, 0, 0);
+        release_incoming(s, 1);
+        return;
+    }
+    verify_incoming(s, ntohl(file_crc), fd);
+}
+
+// The peer already holds a version including what we are streaming: record it and stop.
+// Chunks still in flight are drained on the other side, which has no stream for them.
+void receive_have(int fd) {
+    VersionVector vv;
+    if (recv_name(fd, msg_name, sizeof(msg_name)) < 0 || recv_vv(fd, &vv) < 0) return;
+    PathEntry *e = path_entry(msg_name, 0);
+    if (!e) return;
+    vv_sent(e, &vv);
+    for (int i = 0; i < outgoing_count; i++)
+        if (outgoing[i].entry == e && !vv_newer(&outgoing[i].vv, &vv)) {
+            release_stream(i);
+            printf("? Peer already has: %s\n", e->rel);
+            break;
+        }
+}
+
+// Local fast path: clone or copy the file straight out of the peer's directory.
+void receive_local(int fd) {
+    uint64_t fs;
+    mode_t pm;
+    struct utimbuf ut;
+    VersionVector vv;
+    PathEntry *e = recv_file_header(fd, &fs, &pm, &ut, &vv);
+    if (!e) return;
+    int ret = snprintf(msg_full2, sizeof(msg_full2), "%s/%s", peer_dir, e->rel);
+    if (ret < 0 || ret >= (int)sizeof(msg_full2)) return;
+    int src = open(msg_full2, O_RDONLY);
+    if (src < 0) return;
+    IncomingStream *s = open_incoming(e, msg_full, fs, pm, &ut, &vv, fd);
+    if (!s) {
+        close(src);
+        return;
+    }
+
+    const char *how = "reflink";
+    ssize_t n = 0;
+    if (ioctl(s->fd, FICLONE, src) < 0) {
+        how = "copy_file_range";
+        while ((n = copy_file_range(src, NULL, s->fd, NULL, 1 << 30, 0)) > 0);
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+            how = "read/write";
+            lseek(src, 0, SEEK_SET);
+            ftruncate(s->fd, 0);
+            lseek(s->fd, 0, SEEK_SET);
+            while ((n = read(src, chunk_buf, CHUNK_SIZE)) > 0)
+                if (write(s->fd, chunk_buf, n) != n) {
+                    n = -1;
+                    break;
+                }
+        }
+    }
+    close(src);
+    if (n < 0) {
+        fprintf(stderr, "Warning: local copy of %s failed (%s), asking for a socket transfer\n", e->rel, strerror(errno));
+        send_chunk_request(fd, e->rel, 0, 0);
+        release_incoming(s, 1);
+        return;
+    }
+    printf("? Local copy (%s): %s\n", how, e->rel);
+    commit_incoming(s);
+}
+
+// Applies a directory's batch of attribute updates. A file whose size no longer matches
+// is not the same file the sender has; ask for its contents instead.
+void receive_meta(int fd) {
+    uint32_t count, applied = 0;
+    if (recv_name(fd, msg_name2, sizeof(msg_name2)) < 0) return;
+    if (recv_all(fd, &count, sizeof(count)) <= 0) return;
+    count = ntohl(count);
+    int ret = snprintf(msg_full2, sizeof(msg_full2), "%s%s%s", WATCH_DIR, msg_name2[0] ? "/" : "", msg_name2);
+    int dfd = ret < 0 || ret >= (int)sizeof(msg_full2) ? -1 : open(msg_full2, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t size, asec, msec;
+        uint32_t mode, uid, gid, ansec, mnsec, nx;
+        if (recv_name(fd, msg_name, sizeof(msg_name)) < 0 || recv_all(fd, &size, sizeof(size)) <= 0 ||
+            recv_all(fd, &mode, sizeof(mode)) <= 0 || recv_all(fd, &uid, sizeof(uid)) <= 0 ||
+            recv_all(fd, &gid, sizeof(gid)) <= 0 || recv_all(fd, &asec, sizeof(asec)) <= 0 ||
+            recv_all(fd, &ansec, sizeof(ansec)) <= 0 || recv_all(fd, &msec, sizeof(msec)) <= 0 ||
+            recv_all(fd, &mnsec, sizeof(mnsec)) <= 0 || recv_all(fd, &nx, sizeof(nx)) <= 0)
+            break;
+        ret = snprintf(msg_full, sizeof(msg_full), "%s/%s", msg_full2, msg_name);
+        struct stat st;
+        int ok = dfd >= 0 && ret > 0 && ret < (int)sizeof(msg_full) &&
+                 fstatat(dfd, msg_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode);
+        if (ok) vv_note_local(path_entry(rel_of(msg_full), 1), &st);
+        if (ok && st.st_size != (off_t)be64toh(size)) {
+            send_chunk_request(fd, rel_of(msg_full), 0, 0);
+            ok = 0;
+        }
+        for (nx = ntohl(nx); nx > 0; nx--) {
+            char xn[XATTR_NAME_MAX + 1];
+            uint32_t vl;
+            if (recv_name(fd, xn, sizeof(xn)) < 0 || recv_all(fd, &vl, sizeof(vl)) <= 0) goto out;
+            vl = ntohl(vl);
+            if (vl > sizeof(xattr_value)) goto out;
+            if (vl && recv_all(fd, xattr_value, vl) <= 0) goto out;
+            if (ok && strncmp(xn, "user.", 5) == 0) lsetxattr(msg_full, xn, xattr_value, vl, 0);
+        }
+        if (!ok) continue;
+
+        fchmodat(dfd, msg_name, ntohl(mode) & 07777, 0);
+        // Ownership only sticks with the privileges for it; mode and times apply regardless.
+        if (st.st_uid != ntohl(uid) || st.st_gid != ntohl(gid))
+            fchownat(dfd, msg_name, ntohl(uid), ntohl(gid), AT_SYMLINK_NOFOLLOW);
+        struct timespec ts[2] = { { be64toh(asec), ntohl(ansec) }, { be64toh(msec), ntohl(mnsec) } };
+        utimensat(dfd, msg_name, ts, AT_SYMLINK_NOFOLLOW);
+        PathEntry *e = path_entry(rel_of(msg_full), 1);
+        if (e && fstatat(dfd, msg_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            remember_sent(e, st.st_mtime, st.st_size);
+            vv_settle(e, &st);
+            remember_meta(e, &st);
+        }
+        applied++;
+    }
+out:
+    if (dfd >= 0) close(dfd);
+    log_event("SERVER->CLIENT", "Metadata", msg_name2[0] ? msg_name2 : ".", NULL);
+    printf("? Metadata received: %s (%u of %u files)\n", msg_name2[0] ? msg_name2 : ".", applied, count);
+}
+
+// The peer lost its copy in transit; it still holds whatever it had before.
+void forget_sent(PathEntry *e) {
+    if (!e) return;
+    memset(&e->peer_vv, 0, sizeof(e->peer_vv));
+}
+
+void receive_chunk_request(int fd) {
+    uint64_t off;
+    uint32_t cl;
+    if (recv_path(fd, msg_name, msg_full) < 0) return;
+    if (recv_all(fd, &off, sizeof(off)) <= 0) return;
+    if (recv_all(fd, &cl, sizeof(cl)) <= 0) return;
+    off = be64toh(off);
+    cl = ntohl(cl);
+    const char *fn = msg_name, *full = msg_full;
+
+    if (cl == 0) {
+        if (local_peer) {
+            fprintf(stderr, "Warning: peer could not copy %s locally, falling back to socket transfers\n", fn);
+            local_peer = 0;
+        }
+        PathEntry *e = path_entry(fn, 0);
+        forget_sent(e);
+        // The peer has dropped what it had of a stream still going out, so start that over.
+        for (int i = 0; e && i < outgoing_count; i++)
+            if (outgoing[i].entry == e) {
+                release_stream(i);
+                break;
+            }
+        enqueue_transfer(full);
+        return;
+    }
+    if (cl > CHUNK_SIZE) cl = CHUNK_SIZE;
+    int src = open(full, O_RDONLY);
+    if (src < 0) return;
+    ssize_t n = pread(src, chunk_buf, cl, off);
+    close(src);
+    if (n < (ssize_t)cl) memset(chunk_buf + (n > 0 ? n : 0), 0, cl - (n > 0 ? n : 0));
+    send_chunk(fd, fn, off, chunk_buf, cl, crc32c(0, chunk_buf, cl), NULL);
+    printf("? Resent chunk: %s @%llu\n", fn, (unsigned long long)off);
+}
+
+void receive_message(int fd) {
+    uint8_t msg_type;
+    ssize_t r = recv_all(fd, &msg_type, 1);
+    if (r <= 0) return;
+    switch (msg_type) {
+    case MSG_TYPE_FILE_SEND: {
+        uint64_t fs;
+        mode_t pm;
+        struct utimbuf ut;
+        VersionVector vv;
+        PathEntry *e = recv_file_header(fd, &fs, &pm, &ut, &vv);
+        if (!e) return;
+
+        // Always drain the payload and trailer so the stream stays in sync. Each chunk is
+        // hashed as it arrives; the expected CRCs follow the payload.
+        IncomingStream *s = open_incoming(e, msg_full, fs, pm, &ut, &vv, fd);
+        size_t got = 0;
         while (got < fs) {
-            size_t to_read = (fs - got < BUFSIZE ? fs - got : BUFSIZE);
-            ssize_t r = recv(fd, buf, to_read, 0);
+            size_t to_read = (fs - got < CHUNK_SIZE ? fs - got : CHUNK_SIZE);
+            ssize_t r = recv_all(fd, chunk_buf, to_read);
             if (r <= 0) break;
-            fwrite(buf, 1, r, f);
+            if (s && add_chunk_sum(s, got, r, 0) == 0) {
+                uint32_t c = crc32c(0, chunk_buf, r);
+                s->actual[s->nsums - 1] = pwrite(s->fd, chunk_buf, r, got) == r ? c : ~c;
+            }
             got += r;
         }
-        fclose(f);
-        chmod(full, pm);
-        utime(full, &ut);
-        log_event("CLIENT->SERVER", "Received", fn, NULL);
-        printf("? Received: %s\n", fn);
-
-        pthread_mutex_lock(&recent_recv_mutex);
-        int found = 0;
-        time_t now = time(NULL);
-        for (int i = 0; i < recent_count; i++) {
-            if (strcmp(recently_received[i].filename, full) == 0) {
-                recently_received[i].received_time = now;
-                found = 1;
-                break;
-            }
+        uint32_t nc, crc, file_crc;
+        if (recv_all(fd, &nc, sizeof(nc)) <= 0) return;
+        nc = ntohl(nc);
+        int ok = nc == (fs + CHUNK_SIZE - 1) / CHUNK_SIZE && (!s || s->nsums == nc);
+        for (uint32_t i = 0; i < nc; i++) {
+            if (recv_all(fd, &crc, sizeof(crc)) <= 0) return;
+            if (s && ok) s->sums[i].crc = ntohl(crc);
         }
-        if (!found && recent_count < MAX_RECEIVED) {
-            strcpy(recently_received[recent_count].filename, full);
-            recently_received[recent_count].received_time = now;
-            recent_count++;
+        if (recv_all(fd, &file_crc, sizeof(file_crc)) <= 0) return;
+        if (!s) break;
+        if (!ok) {
+            send_chunk_request(fd, e->rel, 0, 0);
+            release_incoming(s, 1);
+            break;
         }
-        pthread_mutex_unlock(&recent_recv_mutex);
-        sleep(5);
+        verify_incoming(s, ntohl(file_crc), fd);
         break;
     }
     case MSG_TYPE_FILE_DELETE:
@@ -382,14 +2660,886 @@ void receive_message(int fd) {
     case MSG_TYPE_FILE_RENAME:
         receive_rename(fd);
         break;
+    case MSG_TYPE_FILE_BEGIN:
+        receive_stream_begin(fd);
+        break;
+    case MSG_TYPE_FILE_CHUNK:
+        receive_stream_chunk(fd);
+        break;
+    case MSG_TYPE_FILE_END:
+        receive_stream_end(fd);
+        break;
+    case MSG_TYPE_CHUNK_REQ:
+        receive_chunk_request(fd);
+        break;
+    case MSG_TYPE_FILE_LOCAL:
+        receive_local(fd);
+        break;
+    case MSG_TYPE_META:
+        receive_meta(fd);
+        break;
+    case MSG_TYPE_FILE_HAVE:
+        receive_have(fd);
+        break;
     default:
         fprintf(stderr, "Unknown message type %u\n", msg_type);
         break;
     }
 }
 
-int main() {
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Bulk seeding (--seed). The tree is walked by SEED_WALKERS threads and sent in inode
+// order for mostly sequential reads: one reader fills blocks, HASH_THREADS workers
+// checksum and compress them, and one sender per seed connection writes them out as a
+// stream of SEED_FILE/SEED_BLOCK records ending in SEED_END. Each file travels on a
+// single connection, with its SEED_FILE record ahead of its blocks.
+SeedState seed_tx, seed_rx;
+SeedQueue seed_free, seed_work, seed_out[SEED_STREAMS];
+int seed_conns[SEED_STREAMS], seed_rconns[SEED_STREAMS], seed_nconns = 0; // sending, receiving
+uint64_t seed_raw_bytes = 0, seed_wire_bytes = 0;
+
+void seed_queue_init(SeedQueue *q) {
+    memset(q, 0, sizeof(*q));
+    pthread_mutex_init(&q->mu, NULL);
+    pthread_cond_init(&q->cv, NULL);
+}
+
+void seed_push(SeedQueue *q, SeedBlock *b) {
+    b->next = NULL;
+    pthread_mutex_lock(&q->mu);
+    if (q->tail) q->tail->next = b;
+    else q->head = b;
+    q->tail = b;
+    pthread_cond_signal(&q->cv);
+    pthread_mutex_unlock(&q->mu);
+}
+
+// Waits for a block; NULL once the queue is closed and drained.
+SeedBlock *seed_pop(SeedQueue *q) {
+    pthread_mutex_lock(&q->mu);
+    while (!q->head && !q->closed) pthread_cond_wait(&q->cv, &q->mu);
+    SeedBlock *b = q->head;
+    if (b && !(q->head = b->next)) q->tail = NULL;
+    pthread_mutex_unlock(&q->mu);
+    return b;
+}
+
+void seed_close(SeedQueue *q) {
+    pthread_mutex_lock(&q->mu);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->cv);
+    pthread_mutex_unlock(&q->mu);
+}
+
+// Appends under st->mu; returns the index, or -1 when out of memory.
+long seed_add_file(SeedState *st, const char *rel, const struct stat *sb) {
+    if (st->nfiles == st->fcap) {
+        size_t cap = st->fcap ? st->fcap * 2 : 1024;
+        SeedFile *f = counted_realloc(st->files, cap * sizeof(SeedFile));
+        if (!f) return -1;
+        st->files = f;
+        st->fcap = cap;
+    }
+    const char *copy = arena_strdup(&st->arena, rel);
+    if (!copy) return -1;
+    st->files[st->nfiles] = (SeedFile){ copy, sb->st_ino, sb->st_size, sb->st_mode, { sb->st_atime, sb->st_mtime }, 0 };
+    return st->nfiles++;
+}
+
+void seed_walk_dir(SeedState *st, const char *dir) {
+    char path[MAX_PATH], dents[4096];
+    int ret = snprintf(path, sizeof(path), "%s%s%s", WATCH_DIR, *dir ? "/" : "", dir);
+    if (ret < 0 || ret >= (int)sizeof(path)) return;
+    int dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) return;
+    ssize_t n;
+    while ((n = getdents64(dfd, dents, sizeof(dents))) > 0) {
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64 *e = (struct dirent64 *)(dents + off);
+            off += e->d_reclen;
+            if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+            ret = snprintf(path, sizeof(path), "%s%s%s", dir, *dir ? "/" : "", e->d_name);
+            if (ret < 0 || ret >= (int)sizeof(path)) {
+                fprintf(stderr, "Warning: path too long and truncated: %s/%s\n", dir, e->d_name);
+                continue;
+            }
+            struct stat sb;
+            if (rule_excluded(path, e->d_type == DT_DIR)) continue;
+            if (e->d_type == DT_DIR) {
+                pthread_mutex_lock(&st->mu);
+                if (st->ndirs == st->dcap) {
+                    size_t cap = st->dcap ? st->dcap * 2 : 256;
+                    const char **d = counted_realloc(st->dirs, cap * sizeof(char *));
+                    if (d) {
+                        st->dirs = d;
+                        st->dcap = cap;
+                    }
+                }
+                const char *copy = st->ndirs < st->dcap ? arena_strdup(&st->arena, path) : NULL;
+                if (copy) {
+                    st->dirs[st->ndirs++] = copy;
+                    pthread_cond_signal(&st->cv);
+                }
+                pthread_mutex_unlock(&st->mu);
+            } else if (e->d_type == DT_REG && !is_temp_name(e->d_name) &&
+                       fstatat(dfd, e->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+                pthread_mutex_lock(&st->mu);
+                seed_add_file(st, path, &sb);
+                pthread_mutex_unlock(&st->mu);
+            }
+        }
+    }
+    close(dfd);
+}
+
+// Directories are a shared stack; the walk is over when it is empty and no walker is busy.
+void *seed_walker(void *arg) {
+    SeedState *st = arg;
+    pthread_mutex_lock(&st->mu);
+    for (;;) {
+        while (!st->ndirs && st->busy) pthread_cond_wait(&st->cv, &st->mu);
+        if (!st->ndirs) break;
+        const char *dir = st->dirs[--st->ndirs];
+        st->busy++;
+        pthread_mutex_unlock(&st->mu);
+        seed_walk_dir(st, dir);
+        pthread_mutex_lock(&st->mu);
+        st->busy--;
+    }
+    pthread_cond_broadcast(&st->cv);
+    pthread_mutex_unlock(&st->mu);
+    return NULL;
+}
+
+int seed_by_inode(const void *a, const void *b) {
+    ino_t x = ((const SeedFile *)a)->ino, y = ((const SeedFile *)b)->ino;
+    return x < y ? -1 : x > y;
+}
+
+// Files go to the connection with the fewest bytes assigned so far.
+void *seed_reader(void *arg) {
+    (void)arg;
+    char path[MAX_PATH];
+    uint64_t load[SEED_STREAMS] = {0};
+    for (size_t i = 0; i < seed_tx.nfiles; i++) {
+        SeedFile *f = &seed_tx.files[i];
+        int ret = snprintf(path, sizeof(path), "%s/%s", WATCH_DIR, f->rel);
+        if (ret < 0 || ret >= (int)sizeof(path)) continue;
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue; // gone since the walk; inotify reports the delete
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        int conn = 0;
+        for (int c = 1; c < seed_nconns; c++)
+            if (load[c] < load[conn]) conn = c;
+        load[conn] += f->size + 512;
+
+        SeedBlock *b = seed_pop(&seed_free);
+        b->kind = SEED_FILE;
+        b->conn = conn;
+        b->file = i;
+        seed_push(&seed_out[conn], b);
+        for (off_t off = 0; off < f->size; off += CHUNK_SIZE) {
+            b = seed_pop(&seed_free);
+            size_t want = f->size - off < CHUNK_SIZE ? f->size - off : CHUNK_SIZE;
+            ssize_t r = pread(fd, b->data, want, off);
+            // A file that shrank mid-read is padded; its new mtime sends it again afterwards.
+            if (r < (ssize_t)want) memset(b->data + (r > 0 ? r : 0), 0, want - (r > 0 ? r : 0));
+            b->kind = SEED_BLOCK;
+            b->conn = conn;
+            b->file = i;
+            b->offset = off;
+            b->len = want;
+            seed_push(&seed_work, b);
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+        f->ok = 1;
+    }
+    seed_close(&seed_work);
+    return NULL;
+}
+
+// Blocks are compressed only when that makes them smaller.
+void *seed_worker(void *arg) {
+    (void)arg;
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    int zok = deflateInit(&z, Z_BEST_SPEED) == Z_OK;
+    SeedBlock *b;
+    while ((b = seed_pop(&seed_work))) {
+        b->crc = crc32c(0, b->data, b->len);
+        b->stored = b->len;
+        if (zok && deflateReset(&z) == Z_OK) {
+            z.next_in = b->data;
+            z.avail_in = b->len;
+            z.next_out = b->zdata;
+            z.avail_out = b->len;
+            if (deflate(&z, Z_FINISH) == Z_STREAM_END && z.total_out < b->len) b->stored = z.total_out;
+        }
+        seed_push(&seed_out[b->conn], b);
+    }
+    if (zok) deflateEnd(&z);
+    return NULL;
+}
+
+void *seed_sender(void *arg) {
+    int c = (int)(intptr_t)arg, fd = seed_conns[c];
+    SeedBlock *b;
+    while ((b = seed_pop(&seed_out[c]))) {
+        uint8_t type = b->kind;
+        uint32_t id = htonl(b->file);
+        send_all(fd, &type, 1);
+        send_all(fd, &id, sizeof(id));
+        if (b->kind == SEED_FILE) {
+            const SeedFile *f = &seed_tx.files[b->file];
+            uint32_t nl = htonl(strlen(f->rel)), nb = htonl((f->size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+            uint64_t fs = htobe64(f->size);
+            send_all(fd, &nl, sizeof(nl));
+            send_all(fd, f->rel, strlen(f->rel));
+            send_all(fd, &fs, sizeof(fs));
+            send_all(fd, &f->mode, sizeof(f->mode));
+            send_all(fd, &f->ut, sizeof(f->ut));
+            send_all(fd, &nb, sizeof(nb));
+            send_vv(fd, &f->vv);
+        } else {
+            uint64_t off = htobe64(b->offset);
+            uint32_t len = htonl(b->len), stored = htonl(b->stored), crc = htonl(b->crc);
+            send_all(fd, &off, sizeof(off));
+            send_all(fd, &len, sizeof(len));
+            send_all(fd, &stored, sizeof(stored));
+            send_all(fd, &crc, sizeof(crc));
+            send_paced(fd, b->stored < b->len ? b->zdata : b->data, b->stored);
+            __atomic_add_fetch(&seed_raw_bytes, b->len, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&seed_wire_bytes, b->stored, __ATOMIC_RELAXED);
+        }
+        seed_push(&seed_free, b);
+    }
+    uint8_t end = SEED_END;
+    send_all(fd, &end, 1);
+    return NULL;
+}
+
+void seed_finish(SeedOpen *o) {
+    char full[MAX_PATH], temp[MAX_PATH];
+    if (o->fd >= 0) {
+        fchmod(o->fd, o->mode);
+        close(o->fd);
+    }
+    snprintf(full, sizeof(full), "%s/%s", WATCH_DIR, o->rel);
+    temp_path(full, temp, sizeof(temp));
+    // A file we already have is left in temp for run_seed() to weigh the versions on the main thread.
+    struct stat st;
+    int deferred = !o->bad && lstat(full, &st) == 0;
+    if (!o->bad) {
+        utime(temp, &o->ut);
+        if (!deferred && rename(temp, full) < 0) o->bad = 1;
+    }
+    if (o->bad) unlink(temp);
+    pthread_mutex_lock(&seed_rx.mu);
+    seed_rx.files[o->result].ok = !o->bad;
+    seed_rx.files[o->result].deferred = deferred;
+    pthread_mutex_unlock(&seed_rx.mu);
+}
+
+// One per seed connection: applies the peer's records until SEED_END or the connection drops.
+void *seed_receiver(void *arg) {
+    int fd = seed_rconns[(intptr_t)arg];
+    unsigned char *zbuf = counted_realloc(NULL, CHUNK_SIZE), *buf = counted_realloc(NULL, CHUNK_SIZE);
+    char name[MAX_PATH], full[MAX_PATH], temp[MAX_PATH];
+    SeedOpen *open_files = NULL;
+    size_t nopen = 0, cap = 0;
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    int zok = inflateInit(&z) == Z_OK;
+    uint8_t type;
+    while (zbuf && buf && recv_all(fd, &type, 1) > 0 && type != SEED_END) {
+        uint32_t id;
+        if (recv_all(fd, &id, sizeof(id)) <= 0) break;
+        id = ntohl(id);
+        if (type == SEED_FILE) {
+            uint64_t fs;
+            uint32_t nb;
+            struct utimbuf ut;
+            struct stat sb = {0};
+            VersionVector vv;
+            if (recv_name(fd, name, sizeof(name)) < 0 || recv_all(fd, &fs, sizeof(fs)) <= 0 ||
+                recv_all(fd, &sb.st_mode, sizeof(sb.st_mode)) <= 0 || recv_all(fd, &ut, sizeof(ut)) <= 0 ||
+                recv_all(fd, &nb, sizeof(nb)) <= 0 || recv_vv(fd, &vv) < 0)
+                break;
+            sb.st_size = be64toh(fs);
+            sb.st_atime = ut.actime;
+            sb.st_mtime = ut.modtime;
+            if (nopen == cap) {
+                cap = cap ? cap * 2 : 16;
+                SeedOpen *n = counted_realloc(open_files, cap * sizeof(SeedOpen));
+                if (!n) break;
+                open_files = n;
+            }
+            pthread_mutex_lock(&seed_rx.mu);
+            long idx = seed_add_file(&seed_rx, name, &sb);
+            if (idx >= 0) seed_rx.files[idx].vv = vv;
+            const char *rel = idx >= 0 ? seed_rx.files[idx].rel : NULL;
+            pthread_mutex_unlock(&seed_rx.mu);
+            if (idx < 0) break;
+            SeedOpen *o = &open_files[nopen++];
+            *o = (SeedOpen){ id, -1, ntohl(nb), 0, idx, rel, sb.st_mode, ut };
+            int ret = snprintf(full, sizeof(full), "%s/%s", WATCH_DIR, rel);
+            if (ret >= 0 && ret < (int)sizeof(full) && temp_path(full, temp, sizeof(temp)) == 0) {
+                ensure_parent(full);
+                o->fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+                if (o->fd >= 0 && ftruncate(o->fd, sb.st_size) < 0) o->bad = 1;
+            }
+            if (o->fd < 0) o->bad = 1;
+            if (o->left == 0) {
+                seed_finish(o);
+                *o = open_files[--nopen];
+            }
+        } else if (type == SEED_BLOCK) {
+            uint64_t off;
+            uint32_t len, stored, crc;
+            if (recv_all(fd, &off, sizeof(off)) <= 0 || recv_all(fd, &len, sizeof(len)) <= 0 ||
+                recv_all(fd, &stored, sizeof(stored)) <= 0 || recv_all(fd, &crc, sizeof(crc)) <= 0)
+                break;
+            off = be64toh(off);
+            len = ntohl(len);
+            stored = ntohl(stored);
+            crc = ntohl(crc);
+            if (len > CHUNK_SIZE || stored > len) {
+                fprintf(stderr, "Warning: bad seed block (%u/%u bytes), dropping seed stream\n", stored, len);
+                break;
+            }
+            if (recv_all(fd, zbuf, stored) <= 0) break;
+            size_t i = 0;
+            while (i < nopen && open_files[i].id != id) i++;
+            if (i == nopen) continue;
+            SeedOpen *o = &open_files[i];
+            unsigned char *data = zbuf;
+            if (stored < len) {
+                data = buf;
+                z.next_in = zbuf;
+                z.avail_in = stored;
+                z.next_out = buf;
+                z.avail_out = len;
+                if (!zok || inflateReset(&z) != Z_OK || inflate(&z, Z_FINISH) != Z_STREAM_END || z.total_out != len)
+                    o->bad = 1;
+            }
+            if (!o->bad && crc32c(0, data, len) != crc) o->bad = 1;
+            if (!o->bad && pwrite(o->fd, data, len, off) != (ssize_t)len) o->bad = 1;
+            if (--o->left == 0) {
+                seed_finish(o);
+                *o = open_files[--nopen];
+            }
+        } else {
+            fprintf(stderr, "Warning: unknown seed record %u, dropping seed stream\n", type);
+            break;
+        }
+    }
+    // Files still open were cut short
+    for (size_t i = 0; i < nopen; i++) {
+        open_files[i].bad = 1;
+        seed_finish(&open_files[i]);
+    }
+    if (zok) inflateEnd(&z);
+    free(open_files);
+    free(zbuf);
+    free(buf);
+    return NULL;
+}
+
+void seed_walk(void) {
+    pthread_t th[SEED_WALKERS];
+    int n = 0;
+    seed_tx.dirs = counted_realloc(NULL, 256 * sizeof(char *));
+    if (!seed_tx.dirs) return;
+    seed_tx.dcap = 256;
+    seed_tx.dirs[seed_tx.ndirs++] = "";
+    while (n < SEED_WALKERS && pthread_create(&th[n], NULL, seed_walker, &seed_tx) == 0) n++;
+    if (!n) seed_walker(&seed_tx);
+    for (int i = 0; i < n; i++) pthread_join(th[i], NULL);
+    qsort(seed_tx.files, seed_tx.nfiles, sizeof(SeedFile), seed_by_inode);
+}
+
+void seed_send(void) {
+    SeedBlock blocks[SEED_BLOCKS];
+    pthread_t reader, workers[HASH_THREADS], senders[SEED_STREAMS];
+    int nblocks = 0, nworkers = 0;
+    seed_queue_init(&seed_free);
+    seed_queue_init(&seed_work);
+    for (int c = 0; c < seed_nconns; c++) seed_queue_init(&seed_out[c]);
+    while (nblocks < SEED_BLOCKS) {
+        SeedBlock *b = &blocks[nblocks];
+        memset(b, 0, sizeof(*b));
+        b->data = counted_realloc(NULL, CHUNK_SIZE);
+        b->zdata = counted_realloc(NULL, CHUNK_SIZE);
+        if (!b->data || !b->zdata) {
+            free(b->data);
+            free(b->zdata);
+            break;
+        }
+        seed_push(&seed_free, b);
+        nblocks++;
+    }
+    if (nblocks < 2) {
+        fprintf(stderr, "Warning: no memory for seed buffers\n");
+        return;
+    }
+    for (int c = 0; c < seed_nconns; c++) pthread_create(&senders[c], NULL, seed_sender, (void *)(intptr_t)c);
+    while (nworkers < HASH_THREADS && pthread_create(&workers[nworkers], NULL, seed_worker, NULL) == 0) nworkers++;
+    if (!nworkers) seed_close(&seed_work); // the reader would wait on blocks nobody hashes
+    pthread_create(&reader, NULL, seed_reader, NULL);
+    pthread_join(reader, NULL);
+    for (int i = 0; i < nworkers; i++) pthread_join(workers[i], NULL);
+    for (int c = 0; c < seed_nconns; c++) seed_close(&seed_out[c]);
+    for (int c = 0; c < seed_nconns; c++) pthread_join(senders[c], NULL);
+    for (int i = 0; i < nblocks; i++) {
+        free(blocks[i].data);
+        free(blocks[i].zdata);
+    }
+}
+
+// Extra connections to open for the seed. A TLS session must not be written by a sender
+// thread while a receiver thread reads it, so a two-way seed over TLS uses a separate set
+// per direction: the server's sending connections first, then the client's.
+int seed_conn_count(void) {
+    if (!seed_mode && !peer_seeds) return 0;
+    return use_tls && seed_mode && peer_seeds ? 2 * SEED_STREAMS : SEED_STREAMS;
+}
+
+// Runs the bulk seed over the n extra connections in tx[] and rx[], in both directions if
+// both peers asked for it, then records every file that moved so the incremental loop starts
+// from a synced state instead of rescanning. Files that failed are re-requested on fd.
+// tx and rx may be the same connections, except under TLS (see seed_conn_count()).
+void run_seed(int *tx, int *rx, int n, int fd) {
+    if (!n) return;
+    memcpy(seed_conns, tx, n * sizeof(int));
+    memcpy(seed_rconns, rx, n * sizeof(int));
+    seed_nconns = n;
+    pthread_mutex_init(&seed_tx.mu, NULL);
+    pthread_cond_init(&seed_tx.cv, NULL);
+    pthread_mutex_init(&seed_rx.mu, NULL);
+    pthread_t receivers[SEED_STREAMS];
+    int nrecv = 0;
+    double start = now_seconds();
+    if (peer_seeds)
+        while (nrecv < n && pthread_create(&receivers[nrecv], NULL, seed_receiver, (void *)(intptr_t)nrecv) == 0) nrecv++;
+
+    if (seed_mode) {
+        seed_walk();
+        double walked = now_seconds();
+        uint64_t total = 0;
+        for (size_t i = 0; i < seed_tx.nfiles; i++) total += seed_tx.files[i].size;
+        printf("? Seed: %zu files, %.1f MB found in %.2f s, sending over %d connections\n", seed_tx.nfiles,
+               total / 1048576.0, walked - start, n);
+        if (!nrecv && peer_seeds) fprintf(stderr, "Warning: could not start seed receivers\n");
+        // Versions are counted here on the main thread; the senders only copy them out.
+        for (size_t i = 0; i < seed_tx.nfiles; i++) {
+            SeedFile *f = &seed_tx.files[i];
+            PathEntry *e = path_entry(f->rel, 1);
+            struct stat st;
+            if (snprintf(scan_path, sizeof(scan_path), "%s/%s", WATCH_DIR, f->rel) < (int)sizeof(scan_path) &&
+                lstat(scan_path, &st) == 0)
+                vv_note_local(e, &st);
+            if (e) f->vv = e->vv;
+        }
+        seed_send();
+        size_t sent = 0;
+        for (size_t i = 0; i < seed_tx.nfiles; i++) {
+            const SeedFile *f = &seed_tx.files[i];
+            if (!f->ok) continue;
+            PathEntry *e = path_entry(f->rel, 1);
+            remember_sent(e, f->ut.modtime, f->size);
+            if (e) vv_sent(e, &f->vv);
+            sent++;
+        }
+        double secs = now_seconds() - walked;
+        printf("? Seed sent: %zu files, %.1f MB read, %.1f MB on the wire, %.1f MB/s\n", sent,
+               seed_raw_bytes / 1048576.0, seed_wire_bytes / 1048576.0,
+               secs > 0 ? seed_raw_bytes / 1048576.0 / secs : 0.0);
+        char count[32];
+        snprintf(count, sizeof(count), "%zu files", sent);
+        log_event("CLIENT->SERVER", "Seeded", count, NULL);
+    }
+
+    for (int i = 0; i < nrecv; i++) pthread_join(receivers[i], NULL);
+    if (nrecv) {
+        size_t ok = 0;
+        for (size_t i = 0; i < seed_rx.nfiles; i++) {
+            const SeedFile *f = &seed_rx.files[i];
+            PathEntry *e = path_entry(f->rel, 1);
+            if (!e) continue;
+            if (f->ok && f->deferred) {
+                char full[MAX_PATH], temp[MAX_PATH];
+                snprintf(full, sizeof(full), "%s/%s", WATCH_DIR, f->rel);
+                temp_path(full, temp, sizeof(temp));
+                int how = place_received(e, temp, full, &f->vv, f->ut.modtime, f->size);
+                if (how < 0 || how == VV_DROP) unlink(temp);
+                if (how >= 0 && vv_newer(&e->vv, &e->peer_vv)) enqueue_transfer(full);
+                ok++;
+            } else if (f->ok) {
+                vv_merge(&e->vv, &f->vv);
+                vv_sent(e, &f->vv);
+                remember_sent(e, f->ut.modtime, f->size);
+                ok++;
+            } else {
+                send_chunk_request(fd, f->rel, 0, 0);
+            }
+        }
+        printf("? Seed received: %zu files, %zu to be resent, %.2f s\n", ok, seed_rx.nfiles - ok, now_seconds() - start);
+        char count[32];
+        snprintf(count, sizeof(count), "%zu files", ok);
+        log_event("SERVER->CLIENT", "Seeded", count, NULL);
+    }
+
+    for (int i = 0; i < n; i++) {
+        tls_close(tx[i]);
+        close(tx[i]);
+        if (rx == tx) continue;
+        tls_close(rx[i]);
+        close(rx[i]);
+    }
+    free(seed_tx.dirs);
+    free(seed_tx.files);
+    free(seed_rx.files);
+    arena_free(&seed_tx.arena);
+    arena_free(&seed_rx.arena);
+}
+
+void run_hash_benchmark(size_t mb) {
+    size_t len = mb << 20;
+    char *buf = malloc(len);
+    if (!buf) return;
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i + 8 <= len; i += 8) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        memcpy(buf + i, &x, 8);
+    }
+    printf("CRC32C self-test: %s\n", crc32c(0, "123456789", 9) == 0xE3069283 ? "ok" : "FAILED");
+    printf("%-28s %10s\n", "kernel", "GB/s");
+
+    double t = now_seconds();
+    volatile uint32_t sink = crc32c_sw(0, buf, len);
+    printf("%-28s %10.2f\n", "software slicing-by-8", len / (now_seconds() - t) / 1e9);
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        t = now_seconds();
+        sink = crc32c_hw(0, buf, len);
+        printf("%-28s %10.2f\n", "sse4.2 crc32", len / (now_seconds() - t) / 1e9);
+    }
+#endif
+    (void)sink;
+
+    char tmpl[] = "/tmp/sync_bench_XXXXXX";
+    int fd = mkstemp(tmpl);
+    if (fd < 0) {
+        free(buf);
+        return;
+    }
+    unlink(tmpl);
+    if (write(fd, buf, len) != (ssize_t)len) {
+        close(fd);
+        free(buf);
+        return;
+    }
+    uint32_t n = (len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    ChunkSum *sums = calloc(n, sizeof(ChunkSum));
+    uint32_t *out = calloc(n, sizeof(uint32_t));
+    for (uint32_t i = 0; sums && i < n; i++) {
+        sums[i].offset = (uint64_t)i * CHUNK_SIZE;
+        sums[i].len = len - sums[i].offset < CHUNK_SIZE ? len - sums[i].offset : CHUNK_SIZE;
+    }
+    if (sums && out) {
+        HashJob job = { fd, sums, n, 0, out, 0 };
+        t = now_seconds();
+        hash_run(&job, chunk_buf);
+        printf("%-28s %10.2f\n", "chunked pread, 1 thread", len / (now_seconds() - t) / 1e9);
+        t = now_seconds();
+        hash_chunks(fd, sums, n, out);
+        printf("%-28s %10.2f\n", "chunked pread, hash pool", len / (now_seconds() - t) / 1e9);
+    }
+    free(sums);
+    free(out);
+    close(fd);
+    free(buf);
+}
+
+// Fraction of the file's pages currently in the page cache.
+double cached_fraction(int fd, off_t size) {
+    if (size == 0) return 0;
+    void *m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) return -1;
+    long pg = sysconf(_SC_PAGESIZE);
+    size_t pages = (size + pg - 1) / pg, resident = 0;
+    unsigned char *vec = malloc(pages);
+    if (vec && mincore(m, size, vec) == 0)
+        for (size_t i = 0; i < pages; i++) resident += vec[i] & 1;
+    free(vec);
+    munmap(m, size);
+    return (double)resident / pages;
+}
+
+// Reads and hashes path once per strategy, chunk by chunk as a stream would, starting from a cold cache.
+void run_read_benchmark(const char *path) {
+    static const struct { int strategy; const char *name; } modes[] = {
+        { READ_STDIO, "stdio (pread)" }, { READ_MMAP, "mmap" },
+    };
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        perror(path);
+        return;
+    }
+    printf("%-14s %10s %14s\n", "strategy", "GB/s", "cached after");
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        read_strategy = modes[m].strategy;
+        SourceFile src;
+        if (source_open(&src, path, st.st_size) < 0) return;
+        posix_fadvise(src.fd, 0, 0, POSIX_FADV_DONTNEED);
+        double t = now_seconds();
+        uint32_t crc, file_crc = 0;
+        for (off_t off = 0; off < st.st_size; off += CHUNK_SIZE) {
+            size_t want = st.st_size - off < CHUNK_SIZE ? st.st_size - off : CHUNK_SIZE;
+            source_read(&src, off, want, chunk_buf, &crc);
+            file_crc = crc32c_chain(file_crc, crc);
+            source_drop_behind(&src, off + want);
+        }
+        double secs = now_seconds() - t;
+        printf("%-14s %10.2f %13.0f%%\n", modes[m].name, st.st_size / secs / 1e9,
+               cached_fraction(src.fd, st.st_size) * 100);
+        source_close(&src);
+    }
+    read_strategy = READ_AUTO;
+}
+
+void read_boot_id(char *out, size_t len) {
+    out[0] = 0;
+    FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (!f) return;
+    if (fgets(out, len, f)) out[strcspn(out, "\n")] = 0;
+    fclose(f);
+}
+
+// Both peers announce their boot id, watch directory and its device. When the other
+// directory is reachable here on the same filesystem as ours, changes are applied by
+// in-kernel copy instead of over the socket.
+void negotiate_peer(int fd) {
+    char boot[64], dir[MAX_PATH] = "";
+    struct stat st = {0};
+    read_boot_id(boot, sizeof(boot));
+    if (!realpath(WATCH_DIR, dir) || stat(dir, &st) < 0) dir[0] = 0;
+
+    uint8_t msg_type = MSG_TYPE_HELLO, flags = (allow_local ? HELLO_LOCAL : 0) | (seed_mode ? HELLO_SEED : 0);
+    uint32_t bl = htonl(strlen(boot)), dl = htonl(strlen(dir));
+    uint64_t dev = htobe64(st.st_dev);
+    send_all(fd, &msg_type, 1);
+    send_all(fd, &flags, 1);
+    send_all(fd, &bl, sizeof(bl));
+    send_all(fd, boot, strlen(boot));
+    send_all(fd, &dev, sizeof(dev));
+    send_all(fd, &dl, sizeof(dl));
+    send_all(fd, dir, strlen(dir));
+    uint64_t node = htobe64(vv_nodes[0]);
+    send_all(fd, &node, sizeof(node));
+
+    char peer_boot[64], peer_path[MAX_PATH];
+    uint8_t peer_flags;
+    uint64_t peer_dev;
+    if (recv_all(fd, &msg_type, 1) <= 0 || msg_type != MSG_TYPE_HELLO) {
+        fprintf(stderr, "Warning: peer did not send a hello, protocol mismatch?\n");
+        return;
+    }
+    if (recv_all(fd, &peer_flags, 1) <= 0) return;
+    if (recv_name(fd, peer_boot, sizeof(peer_boot)) < 0) return;
+    if (recv_all(fd, &peer_dev, sizeof(peer_dev)) <= 0) return;
+    if (recv_name(fd, peer_path, sizeof(peer_path)) < 0) return;
+    if (recv_all(fd, &node, sizeof(node)) <= 0) return;
+    peer_dev = be64toh(peer_dev);
+    peer_seeds = (peer_flags & HELLO_SEED) != 0;
+    peer_node = be64toh(node);
+    vv_slot(peer_node);
+    // What a different peer holds is unknown: offer it everything, it drops what it has.
+    if (state_peer != peer_node) {
+        for (size_t i = 0; i < path_table_cap; i++)
+            if (path_table[i]) memset(&path_table[i]->peer_vv, 0, sizeof(VersionVector));
+        state_peer = peer_node;
+        state_dirty = 1;
+    }
+
+    struct stat pst;
+    if (allow_local && (peer_flags & HELLO_LOCAL) && boot[0] && dir[0] && strcmp(boot, peer_boot) == 0 &&
+        strcmp(dir, peer_path) != 0 && stat(peer_path, &pst) == 0 &&
+        pst.st_dev == peer_dev && pst.st_dev == st.st_dev) {
+        local_peer = 1;
+        snprintf(peer_dir, sizeof(peer_dir), "%s", peer_path);
+        printf("? Peer directory %s is on this filesystem, using local copies\n", peer_dir);
+    }
+}
+
+// Receiving end of --bench-tls: drains each connection and acknowledges the last byte.
+void *tls_bench_receiver(void *arg) {
+    TlsBench *b = arg;
+    char *buf = malloc(CHUNK_SIZE);
+    for (int r = 0; buf && r < b->rounds; r++) {
+        int c = accept(b->srv, NULL, NULL);
+        if (c < 0) break;
+        if (tls_start(c, 1) == 0) {
+            size_t got = 0;
+            while (got < b->len) {
+                size_t n = b->len - got < CHUNK_SIZE ? b->len - got : CHUNK_SIZE;
+                if (recv_all(c, buf, n) <= 0) break;
+                got += n;
+            }
+            uint8_t ack = 1;
+            send_all(c, &ack, 1);
+        }
+        tls_close(c);
+        close(c);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Sends a mapped file over loopback once per transport, the way streams send file data.
+void run_tls_benchmark(size_t mb) {
+    static const struct { int tls; int ktls; const char *name; } modes[] = {
+        { 0, 0, "plaintext" }, { 1, 0, "userspace TLS" }, { 1, 1, "kernel TLS" },
+    };
+    if (tls_init() < 0) return;
+    size_t len = mb << 20;
+    char tmpl[] = "/tmp/sync_bench_XXXXXX";
+    int fd = mkstemp(tmpl);
+    if (fd < 0) return;
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i + 8 <= CHUNK_SIZE; i += 8) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        memcpy(chunk_buf + i, &x, 8);
+    }
+    size_t written = 0;
+    while (written < len) {
+        size_t n = len - written < CHUNK_SIZE ? len - written : CHUNK_SIZE;
+        if (write(fd, chunk_buf, n) != (ssize_t)n) break;
+        written += n;
+    }
+    read_strategy = READ_MMAP;
+    SourceFile src;
+    int ok = written == len && source_open(&src, tmpl, len) == 0;
+    unlink(tmpl);
+    close(fd);
+    if (!ok) return;
+
+    int srv = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t al = sizeof(addr);
+    if (bind(srv, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(srv, 1) < 0 ||
+        getsockname(srv, (struct sockaddr *)&addr, &al) < 0) {
+        perror("bench socket");
+        close(srv);
+        source_close(&src);
+        return;
+    }
+    TlsBench b = { srv, len, sizeof(modes) / sizeof(modes[0]) };
+    pthread_t th;
+    pthread_create(&th, NULL, tls_bench_receiver, &b);
+    printf("%-16s %10s %14s\n", "transport", "GB/s", "kernel send");
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        // The receiver picks up tls_ctx after this connect, and the previous round is acknowledged.
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+        tls_ktls = modes[m].ktls;
+        if (modes[m].tls && tls_init() < 0) tls_ctx = NULL;
+        int c = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(c, (struct sockaddr *)&addr, sizeof(addr)) < 0 || tls_start(c, 0) < 0 || (modes[m].tls && !tls_ctx)) {
+            printf("%-16s %10s\n", modes[m].name, "failed");
+            close(c);
+            continue;
+        }
+        double t = now_seconds();
+        uint8_t ack = 0;
+        off_t off;
+        for (off = 0; off < (off_t)len; off += CHUNK_SIZE) {
+            size_t n = len - off < CHUNK_SIZE ? len - off : CHUNK_SIZE;
+            if (send_source(c, &src, off, src.map + off, n) != (ssize_t)n) break;
+        }
+        if (off >= (off_t)len && recv_all(c, &ack, 1) > 0)
+            printf("%-16s %10.2f %14s\n", modes[m].name, len / (now_seconds() - t) / 1e9,
+                   !modes[m].tls ? "-" : tls_ktls_send[c] ? "on" : "off");
+        else
+            printf("%-16s %10s\n", modes[m].name, "failed");
+        tls_close(c);
+        close(c);
+    }
+    pthread_join(th, NULL);
+    close(srv);
+    source_close(&src);
+    SSL_CTX_free(tls_ctx);
+    tls_ctx = NULL;
+    tls_ktls = 1;
+    read_strategy = READ_AUTO;
+}
+
+// Returns 0 to continue into sync mode, 1 after running a benchmark, -1 on bad usage.
+int parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--read=auto") == 0) read_strategy = READ_AUTO;
+        else if (strcmp(argv[i], "--read=stdio") == 0) read_strategy = READ_STDIO;
+        else if (strcmp(argv[i], "--read=mmap") == 0) read_strategy = READ_MMAP;
+        else if (strcmp(argv[i], "--no-local") == 0) allow_local = 0;
+        else if (strcmp(argv[i], "--mem-report") == 0) mem_report_every_poll = 1;
+        else if (strcmp(argv[i], "--seed") == 0) seed_mode = 1;
+        else if (strcmp(argv[i], "--xattrs") == 0) sync_xattrs = 1;
+        else if (strcmp(argv[i], "--watcher=inotify") == 0) watcher = WATCH_INOTIFY;
+        else if (strcmp(argv[i], "--watcher=fanotify") == 0) watcher = WATCH_FANOTIFY;
+        else if (strcmp(argv[i], "--tls") == 0) use_tls = 1;
+        else if (strcmp(argv[i], "--no-ktls") == 0) tls_ktls = 0;
+        else if (strcmp(argv[i], "--tls-cert") == 0 && i + 1 < argc) snprintf(tls_cert, sizeof(tls_cert), "%s", argv[++i]);
+        else if (strcmp(argv[i], "--tls-key") == 0 && i + 1 < argc) snprintf(tls_key, sizeof(tls_key), "%s", argv[++i]);
+        else if (strcmp(argv[i], "--tls-ca") == 0 && i + 1 < argc) snprintf(tls_ca, sizeof(tls_ca), "%s", argv[++i]);
+        else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc && parse_rate(argv[i + 1], &global_rate) == 0) i++;
+        else if (strcmp(argv[i], "--peer-rate") == 0 && i + 1 < argc && add_peer_rate(argv[i + 1]) == 0) i++;
+        else if (strcmp(argv[i], "--rate-file") == 0 && i + 1 < argc) {
+            if (load_rate_file(argv[++i]) < 0) return -1;
+        }
+        else if (strcmp(argv[i], "--ignore") == 0 && i + 1 < argc) snprintf(ignore_file, sizeof(ignore_file), "%s", argv[++i]);
+        else if (strcmp(argv[i], "--check-ignore") == 0 && i + 1 < argc) {
+            load_rules();
+            for (i++; i < argc; i++) {
+                struct stat st;
+                int is_dir = stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode);
+                const char *rel = rel_of(argv[i]);
+                printf("%s %s\n", rule_excluded(rel ? rel : argv[i], is_dir) ? "excluded" : "included", argv[i]);
+            }
+            return 1;
+        }
+        else if (strcmp(argv[i], "--bench-hash") == 0) {
+            run_hash_benchmark(i + 1 < argc ? strtoul(argv[i + 1], NULL, 10) : 256);
+            return 1;
+        } else if (strcmp(argv[i], "--bench-tls") == 0) {
+            run_tls_benchmark(i + 1 < argc ? strtoul(argv[i + 1], NULL, 10) : 256);
+            return 1;
+        } else if (strcmp(argv[i], "--bench-read") == 0 && i + 1 < argc) {
+            run_read_benchmark(argv[i + 1]);
+            return 1;
+        } else {
+            fprintf(stderr, "Usage: %s [--read=auto|stdio|mmap] [--no-local] [--mem-report] [--seed] [--xattrs] [--watcher=inotify|fanotify] [--rate BPS] [--peer-rate [IP=]BPS] [--rate-file FILE] [--ignore FILE] [--check-ignore PATH...] [--tls] [--no-ktls] [--tls-cert FILE] [--tls-key FILE] [--tls-ca FILE] [--bench-hash [MB]] [--bench-read FILE] [--bench-tls [MB]]\n", argv[0]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    init_checksums();
+    int args = parse_args(argc, argv);
+    if (args) return args < 0;
+    signal(SIGBUS, on_sigbus);
+    signal(SIGUSR1, on_sigusr1);
     mkdir(WATCH_DIR, 0755);
+    load_rules();
+    load_state();
+    if (use_tls && tls_init() < 0) return 1;
 
     printf("Connect locally? (y/n): ");
     char c[4];
@@ -411,53 +3561,55 @@ int main() {
         exit(1);
     }
     printf("? Connected to %s\n", sip);
+    if (tls_start(sock, 0) < 0) return 1;
+    tls_report(sock);
+    setup_rate_limits(sip);
+    negotiate_peer(sock);
 
-    int ifd = inotify_init1(IN_NONBLOCK);
-    inotify_add_watch(ifd, WATCH_DIR, EVENT_MASK);
+    int wfd = watch_open();
 
-    char moved_from[MAX_PATH] = "";
-    uint32_t moved_cookie = 0;
+    // Seed connections are opened after the hello; changes made meanwhile queue up in the watcher.
+    int seed[2 * SEED_STREAMS], nseed = 0, want = seed_conn_count();
+    while (nseed < want) {
+        seed[nseed] = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(seed[nseed], (struct sockaddr *)&serv, sizeof(serv)) < 0) {
+            perror("connect");
+            exit(1);
+        }
+        if (tls_start(seed[nseed], 0) < 0) return 1;
+        nseed++;
+    }
+    if (nseed > SEED_STREAMS) run_seed(seed + SEED_STREAMS, seed, nseed - SEED_STREAMS, sock);
+    else run_seed(seed, seed, nseed, sock);
 
+    int scanned = 0;
     while (1) {
         fd_set fds;
         FD_ZERO(&fds);
-        FD_SET(ifd, &fds);
+        FD_SET(wfd, &fds);
         FD_SET(sock, &fds);
-        int max = (ifd > sock) ? ifd + 1 : sock + 1;
-        struct timeval to = {2, 0};
+        int max = (wfd > sock) ? wfd + 1 : sock + 1;
+        int busy = pending_count || outgoing_count, buffered = tls_pending(sock);
+        struct timeval to = {busy || buffered ? 0 : 2, 0};
+        if (meta_count && !busy && !buffered) to = (struct timeval){0, META_DELAY_MS * 1000};
         int sel = select(max, &fds, NULL, NULL, &to);
+        if (mem_report_requested) {
+            mem_report_requested = 0;
+            report_memory();
+        }
         if (sel < 0 && errno != EINTR) break;
-        if (sel == 0) {
-            poll_files(sock, WATCH_DIR, "");
+        if (sel == 0 && !busy && !meta_count && !buffered) {
+            // fanotify sees every directory, so it rescans only at startup and on overflow
+            if (watcher != WATCH_FANOTIFY || !scanned) poll_files();
+            else if (state_dirty) save_state();
+            scanned = 1;
+            if (mem_report_every_poll) report_memory();
             continue;
         }
-        if (FD_ISSET(ifd, &fds)) {
-            char buf[4096];
-            int len = read(ifd, buf, sizeof(buf)), i = 0;
-            while (i < len) {
-                struct inotify_event *e = (struct inotify_event *)(buf + i);
-                if (e->len && !(e->mask & IN_ISDIR) && e->name[0] != '.' && !strstr(e->name, ".swp")) {
-                    char fp[MAX_PATH];
-                    snprintf(fp, sizeof(fp), "%s/%s", WATCH_DIR, e->name);
-                    if ((e->mask & IN_MOVED_FROM) && e->cookie) {
-                        strncpy(moved_from, fp, sizeof(moved_from));
-                        moved_cookie = e->cookie;
-                    } else if ((e->mask & IN_MOVED_TO) && (e->cookie && moved_cookie && e->cookie == moved_cookie)) {
-                        char new_fp[MAX_PATH];
-                        snprintf(new_fp, sizeof(new_fp), "%s/%s", WATCH_DIR, e->name);
-                        send_rename(moved_from, new_fp, sock);
-                        moved_from[0] = 0;
-                        moved_cookie = 0;
-                    } else if (e->mask & IN_DELETE) {
-                        send_delete(fp, sock);
-                    } else {
-                        send_file(fp, sock);
-                    }
-                }
-                i += sizeof(*e) + e->len;
-            }
-        }
-        if (FD_ISSET(sock, &fds)) receive_message(sock);
+        if (sel > 0 && FD_ISSET(wfd, &fds)) watch_read(wfd, sock);
+        if ((sel > 0 && FD_ISSET(sock, &fds)) || buffered) receive_message(sock);
+        if (meta_ready()) flush_meta(sock);
+        run_transfers(sock);
     }
     close(sock);
     return 0;